@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stdint.h>
+
 #ifndef AMBILIGHT_SERIAL_BAUD_RATE
 #define AMBILIGHT_SERIAL_BAUD_RATE 1000000
 #endif
@@ -12,13 +14,22 @@
 #endif
 
 #ifndef AMBILIGHT_CHUNKS_PER_STRIP
-// Due to protocol limitations, there can be no more than 255/4=63 chunks per strip.
-// 63*4 gives 252, meaning indices 252..254 are reserved for further extensions.
-// Setting this lower is necessary if the Arduino does not have so much RAM (and it
-// probably doesn't).
+// How much data the Arduino stores for each strip. The original chunk index byte can
+// only address 62 chunks (indices 248..255 are reserved for other requests); beyond
+// that, the host needs to use 16-bit chunk indices, which it does if the Arduino
+// supports them. Keeping this low is necessary if the Arduino does not have much RAM
+// (and it probably doesn't), e.g. 12 is enough for 240 WS2812B LEDs, and 16 for 240
+// APA102 LEDs, but 4 strips of the latter leave little room for anything else.
 #define AMBILIGHT_CHUNKS_PER_STRIP 10
 #endif
 
-static_assert(AMBILIGHT_CHUNKS_PER_STRIP < 63, "exceeding protocol limitations");
+#ifndef AMBILIGHT_SERIAL_RING
+// Size of the Arduino's receive buffer, which must be a power of 2. After a refresh is
+// acknowledged, this many bytes of the next transaction can be sent without waiting for
+// any responses, and will be received while the LEDs are still being refreshed.
+#define AMBILIGHT_SERIAL_RING 1024
+#endif
+
+static_assert(AMBILIGHT_CHUNKS_PER_STRIP * AMBILIGHT_SERIAL_CHUNK < 65536, "exceeding protocol limitations");
 static_assert(AMBILIGHT_SERIAL_CHUNK < 63, "chunk size too big");
-static constexpr uint32_t MAX_LEDS = AMBILIGHT_SERIAL_CHUNK * AMBILIGHT_CHUNKS_PER_STRIP / 4;
+static_assert((AMBILIGHT_SERIAL_RING & (AMBILIGHT_SERIAL_RING - 1)) == 0, "ring size not a power of 2");
@@ -6,12 +6,46 @@
 // if a complete frame is needed. After that, new LED data may follow in chunks of
 // AMBILIGHT_SERIAL_CHUNK bytes, prefixed with a (chunk index * 4 + strip index) byte.
 // The last request should be 254 (for SPI strips) or 255 (for WS281x strips), which
-// refreshes all LEDs updated in this transaction. Requests starting with bytes 252 and
-// 253 are reserved.
+// refreshes all LEDs updated in this transaction. Request 249, followed by a byte with
+// bit 0 set if strips 0 and 1 are SPI strips and bit 1 set if strips 2 and 3 are, lets
+// each pair be a different kind; request 248 is the same as 254 or 255, but refreshes
+// each pair as set by the last 249.
+//
+// Request 253 does nothing, but older versions of this program never respond to it, so
+// it can be used to check whether the following is supported. Request 252 starts a stream:
+// any number of chunks (index byte + data, as above) or patches followed by 248, 254, or 255,
+// and then two bytes of Fletcher-16 checksum (both sums modulo 256) of everything after
+// the 252. There are no responses until the end of the stream; the response to the
+// checksum is ">" if it matches, in which case the LEDs are refreshed as usual, or "<"
+// if some data was lost. Request 251 is the same, but promises that the stream contains
+// the entire frame; if the response to "<RGBDATA" was "<", only such a stream is shown.
+// The patches are:
+//
+//     253, strip, offset (2 bytes, little endian), length, [length bytes]
+//     252, strip, offset (2 bytes, little endian), length, period, [period bytes]
+//     250, strip, chunk index (2 bytes, little endian), [chunk size bytes]
+//
+// The first overwrites `length` bytes of the strip's data starting at `offset`; the
+// second fills them with a repeating pattern (e.g. one LED's color) instead. The third
+// is a chunk with a 16-bit index, which can address more than 62 chunks per strip.
+// Its size is set by request 250, which is followed by the preferred chunk size and
+// answered with the chunk size that will be used and the number of bytes each strip
+// can hold (2 bytes, little endian) before the usual response. Older versions of this
+// program take it for an invalid chunk index and never respond.
 //
 // Strips are driven in pairs (0+1 and 2+3), so the total refresh time depends on the
 // maximum number of LEDs updated in the strips of each pair. For WS2812B-like LEDs,
-// each pair of LEDs takes 27.9us to refresh.
+// each pair of LEDs takes 28.4us to refresh. With AMBILIGHT_OUTPUT_LANES set to 4, all
+// strips are driven at once instead, at 32.3us per LED. If only SPI strips are refreshed,
+// the response to 248 or 254 is sent before the refresh starts, and up to
+// AMBILIGHT_SERIAL_RING bytes received in the meantime are buffered, so the next
+// transaction can begin right away without waiting for a response to "<RGBDATA" (which
+// will arrive once the refresh is done). Refreshing WS2812B-like strips keeps interrupts
+// disabled for all but a moment per byte, which is not often enough to receive anything
+// at full speed, so if there are any, the response is only sent once they are done.
+//
+// The same code builds for the host as part of the emulator in `emulator/`, which
+// replaces the port writes with a delay of the same duration.
 //
 // If incorrect serial data is received, any data takes more than a second to arrive,
 // or there is no data at all for 4 seconds in a row, all strips will display a dim
@@ -21,6 +55,80 @@
 
 #include "pins_arduino.h"
 
+#ifndef AMBILIGHT_OUTPUT_LANES
+// 2: strips 0 and 1 on pins 9 and 10 (SPI clock on 5), then strips 2 and 3 on pins 11 and
+// 12 (SPI clock on 13). 4: all strips at once on pins A3..A0 (SPI clock on A6), which
+// takes a bit more than half as long for the same number of LEDs.
+#define AMBILIGHT_OUTPUT_LANES 2
+#endif
+
+#ifndef AMBILIGHT_HARDWARE_SPI
+// With 2 lanes, drive APA102-like strips 0 and 1 with the SPI and USART peripherals instead,
+// which is about 4 times faster: strip 0 on pins 11 and 13 (clock), strip 1 on pins 1 and
+// 4 (clock). Strips 2 and 3 move to pins 9 and 10 (clock on 5). WS281x-like strips 0 and
+// 1 still work on pins 11 and 1, but are refreshed one after the other.
+#define AMBILIGHT_HARDWARE_SPI 0
+#endif
+
+// Received bytes, filled by the USART interrupt even while the LEDs are being refreshed.
+static uint8_t rxRing[AMBILIGHT_SERIAL_RING];
+static volatile uint16_t rxHead = 0;
+static volatile uint16_t rxTail = 0;
+
+ISR(USART3_RXC_vect) {
+  uint8_t c = USART3.RXDATAL;
+  // If the host sends too much, the checksum will be wrong, so just drop the extra bytes.
+  if ((uint16_t)(rxHead - rxTail) < sizeof(rxRing))
+    rxRing[rxHead++ % sizeof(rxRing)] = c;
+}
+
+// USART3 is connected to the USB-serial converter on Arduino Nano Every. The core's
+// `Serial` has a 64-byte buffer, which is why it's not used.
+static void beginSerial() {
+  PORTMUX.USARTROUTEA = (PORTMUX.USARTROUTEA & ~PORTMUX_USART3_gm) | PORTMUX_USART3_ALT1_gc;
+  PORTB.DIRSET = PIN4_bm; // TX
+  USART3.BAUD = (8 * F_CPU / AMBILIGHT_SERIAL_BAUD_RATE + 1) / 2;
+  USART3.CTRLA = USART_RXCIE_bm;
+  USART3.CTRLB = USART_RXEN_bm | USART_TXEN_bm;
+}
+
+static size_t writeByte(uint8_t c) {
+  while (!(USART3.STATUS & USART_DREIF_bm));
+  USART3.TXDATAL = c;
+  return 1;
+}
+
+// Same as `Serial.readBytes`: give up if any byte takes more than a second to arrive.
+static size_t readBytes(uint8_t* p, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    for (unsigned long start = millis(); ; yield()) {
+      noInterrupts();
+      bool empty = rxHead == rxTail;
+      interrupts();
+      if (!empty)
+        break;
+      if (millis() - start >= 1000)
+        return i;
+    }
+    *p++ = rxRing[rxTail % sizeof(rxRing)];
+    noInterrupts();
+    rxTail++;
+    interrupts();
+  }
+  return n;
+}
+
+// Same as `Serial.find`.
+static bool find(const char* target) {
+  uint8_t c;
+  for (size_t matched = 0; target[matched]; )
+    if (readBytes(&c, 1) != 1)
+      return false;
+    else
+      matched = c == (uint8_t)target[matched] ? matched + 1 : c == (uint8_t)target[0];
+  return true;
+}
+
 struct LEDStripPair {
   LEDStripPair(int pinA, int pinB, int clk)
     : port(&PORTA + digital_pin_to_port[pinA])
@@ -43,14 +151,23 @@ struct LEDStripPair {
 private:
   void showTimed(const uint8_t* A, const uint8_t* B, size_t n) {
     while ((uint16_t)(micros() / 256) == endTime);
+#ifndef __AVR__
+    emulateShow(n, 9.45, true);
+#else
+    // Interrupts may run between bytes, which stretches the low part of the last bit by a
+    // few microseconds. The LEDs only latch after 50us or more, so that's fine. The host
+    // doesn't send anything during this (see `loop`); the USART interrupt couldn't keep up.
     uint8_t a, b, m, z;
     __asm__ volatile (
       "cli"                  "\n" //                                       // cycles (1 cycle = 50 ns)
     "%=0:"                   "\n" // nextByte:                             //     -+
+      "sei"                  "\n" //   sei();                              // 1    |
+      "nop"                  "\n" //   // USART interrupt runs here        // 1    |
+      "cli"                  "\n" //   cli();                              // 1    |
       "ld  %[a], %a[A]+"     "\n" //   a = *A++;                           // 2    |
       "ld  %[b], %a[B]+"     "\n" //   b = *B++;                           // 2    |
       "ldi %[m], 8"          "\n" //   m = 8;                              // 1    |
-    "%=1:"                   "\n" // nextBit:                              //      \- +250ns to first TxL in byte
+    "%=1:"                   "\n" // nextBit:                              //      \- +400ns to first TxL in byte
       "clr  %[z]"            "\n" //   z = 0;                              // 1    |
       "sbrs %[a], 7"         "\n" //   if (!(a & 0x80))                    // 1/2  |
       "or   %[z], %[mA]"     "\n" //     z |= maskA;                       // 1/0  | T0L = 850~950ns
@@ -75,7 +192,7 @@ private:
       "lsl  %[b]"            "\n" //     b <<= 1;                          //   1  |
       "rjmp %=1b"            "\n" //     goto nextBit; }                   //   2  \- +250ns to next TxL
     "%=3:"                   "\n" // end:
-      "sei"                  "\n" // total 27.9us per pixel pair (100ns between bytes + 1150ns per bit) @ 20MHz
+      "sei"                  "\n" // total 28.4us per pixel pair (250ns between bytes + 1150ns per bit) @ 20MHz
       : [a]  "=r"  (a)
       , [b]  "=r"  (b)
       , [m]  "=a"  (m)
@@ -88,9 +205,13 @@ private:
       , [mB]  "la" (maskB)
       , [mAB] "la" (maskA | maskB)
     );
+#endif
   }
 
   void showSPI(const uint8_t* A, const uint8_t* B, size_t n) {
+#ifndef __AVR__
+    emulateShow(n, 6.8);
+#else
     // `w` is current state, `z` is delta for next state. The start frame is 32 zeros.
     uint8_t a, b, m = 32, z, w = 0;
     do port->OUTSET = maskC,
@@ -136,6 +257,7 @@ private:
     );
     do port->OUTSET = maskC,
        port->OUTCLR = maskC; while (--c);
+#endif
   }
 
 private:
@@ -146,52 +268,435 @@ private:
   uint16_t endTime = 0;
 };
 
-// TODO allow strips of different kinds & select strip kind at runtime
+#if AMBILIGHT_OUTPUT_LANES == 4
+// Drives strips 0..3 from pins A3, A2, A1, A0 (PD0..PD3) at the same time, with the clock
+// for SPI strips on A6 (PD4). The pins are fixed so that the assembly can address them
+// as bits of VPORTD instead of going through a pointer (there are only 3 of those, and
+// 4 are needed for the data).
+struct LEDStripQuad {
+  LEDStripQuad() {
+    PORTD.DIRSET = 0x1F;
+    PORTD.OUTCLR = 0x1F;
+  }
+
+  void show(const uint8_t* A, const uint8_t* B, const uint8_t* C, const uint8_t* D, size_t n, bool spi) {
+    if (!n) return;
+    if (spi) showSPI(A, B, C, D, n); else showTimed(A, B, C, D, n);
+    endTime = micros() / 256;
+  }
+
+private:
+  void showTimed(const uint8_t* A, const uint8_t* B, const uint8_t* C, const uint8_t* D, size_t n) {
+    while ((uint16_t)(micros() / 256) == endTime);
+#ifndef __AVR__
+    emulateShow(n, 10.75, true);
+#else
+    // Unlike with 2 lanes, each lane is set and cleared separately, so its timings are
+    // shifted by 1 cycle relative to the previous one. The LEDs don't care. As with 2 lanes,
+    // the host doesn't send anything during this; each byte takes 10.75us even without the
+    // USART interrupt, while they arrive every 10us.
+    uint8_t a, b, c, d, m;
+    const uint8_t* Z;
+    __asm__ volatile (
+      "cli"                  "\n" //                                       // cycles (1 cycle = 50 ns)
+    "%=0:"                   "\n" // nextByte:                             //     -+
+      "sei"                  "\n" //   sei();                              // 1    |
+      "nop"                  "\n" //   // USART interrupt runs here        // 1    |
+      "cli"                  "\n" //   cli();                              // 1    |
+      "movw %[Z], %[A]"      "\n" //   a = *A++;                           // 4    |
+      "ld   %[a], %a[Z]+"    "\n" //                                       //      |
+      "movw %[A], %[Z]"      "\n" //                                       //      |
+      "movw %[Z], %[B]"      "\n" //   b = *B++;                           // 4    |
+      "ld   %[b], %a[Z]+"    "\n" //                                       //      |
+      "movw %[B], %[Z]"      "\n" //                                       //      |
+      "movw %[Z], %[C]"      "\n" //   c = *C++;                           // 4    |
+      "ld   %[c], %a[Z]+"    "\n" //                                       //      |
+      "movw %[C], %[Z]"      "\n" //                                       //      |
+      "movw %[Z], %[D]"      "\n" //   d = *D++;                           // 4    |
+      "ld   %[d], %a[Z]+"    "\n" //                                       //      |
+      "movw %[D], %[Z]"      "\n" //                                       //      |
+      "ldi  %[m], 8"         "\n" //   m = 8;                              // 1    |
+    "%=1:"                   "\n" // nextBit:                              //      \- +1.15us to first TxL in byte
+      "sbi  %[P], 0"         "\n" //   VPORTD.OUT |= 0x0F;                 // 4   -/ T1L = 550ns
+      "sbi  %[P], 1"         "\n" //                                       //      |
+      "sbi  %[P], 2"         "\n" //                                       //      |
+      "sbi  %[P], 3"         "\n" //                                       //      |
+      "sbrs %[a], 7"         "\n" //   if (!(a & 0x80))                    // 8    |
+      "cbi  %[P], 0"         "\n" //     VPORTD.OUT &= ~0x01;              //      |
+      "sbrs %[b], 7"         "\n" //   if (!(b & 0x80))                    //      |
+      "cbi  %[P], 1"         "\n" //     VPORTD.OUT &= ~0x02;              //      |
+      "sbrs %[c], 7"         "\n" //   if (!(c & 0x80))                    //      |
+      "cbi  %[P], 2"         "\n" //     VPORTD.OUT &= ~0x04;              //      |
+      "sbrs %[d], 7"         "\n" //   if (!(d & 0x80))                    //      |
+      "cbi  %[P], 3"         "\n" //     VPORTD.OUT &= ~0x08;              //     -/ T0H = 250ns + 50ns * lane
+      "nop"                  "\n" //                                       // 1    |
+      "cbi  %[P], 0"         "\n" //   VPORTD.OUT &= ~0x0F;                // 4    |
+      "cbi  %[P], 1"         "\n" //                                       //      |
+      "cbi  %[P], 2"         "\n" //                                       //      |
+      "cbi  %[P], 3"         "\n" //                                       //     -/ T1H = 650ns
+      "lsl  %[a]"            "\n" //   a <<= 1;                            // 1    |
+      "lsl  %[b]"            "\n" //   b <<= 1;                            // 1    |
+      "lsl  %[c]"            "\n" //   c <<= 1;                            // 1    |
+      "lsl  %[d]"            "\n" //   d <<= 1;                            // 1    |
+      "dec  %[m]"            "\n" //   if (--m)                            // 1    |
+      "brne %=1b"            "\n" //     goto nextBit;                     // 2/1  |
+      "sbiw %[n], 1"         "\n" //   if (--n)                            //   2  |
+      "brne %=0b"            "\n" //     goto nextByte;                    //   2  |
+      "sei"                  "\n" // total 32.3us per 4 pixels (1200ns per bit + 1150ns more between bytes) @ 20MHz
+      : [a]  "=r"  (a)
+      , [b]  "=r"  (b)
+      , [c]  "=r"  (c)
+      , [d]  "=r"  (d)
+      , [m]  "=a"  (m)
+      , [Z]  "=z"  (Z)
+      , [A]  "+r"  (A)
+      , [B]  "+r"  (B)
+      , [C]  "+r"  (C)
+      , [D]  "+r"  (D)
+      , [n]  "+w"  (n)
+      : [P]  "I"   (_SFR_IO_ADDR(VPORTD_OUT))
+    );
+#endif
+  }
+
+  void showSPI(const uint8_t* A, const uint8_t* B, const uint8_t* C, const uint8_t* D, size_t n) {
+#ifndef __AVR__
+    emulateShow(n, 8.6);
+#else
+    // The start frame is 32 zeros.
+    uint8_t a, b, c, d, m = 32, z;
+    PORTD.OUTCLR = 0x0F;
+    do PORTD.OUTSET = 0x10,
+       PORTD.OUTCLR = 0x10; while (--m);
+    // See the 2-lane version.
+    size_t e = n > 256 ? (n + 7) / 8 : 32;
+    // Bits 0..3 are data, bit 4 is the clock; the rest are written back unchanged.
+    uint8_t w = VPORTD.OUT & 0xE0;
+    const uint8_t* Z;
+    __asm__ volatile(
+    "%=0:"                   "\n" // do {
+      "movw %[Z], %[A]"      "\n" //   a = *A++;
+      "ld   %[a], %a[Z]+"    "\n" //
+      "movw %[A], %[Z]"      "\n" //
+      "movw %[Z], %[B]"      "\n" //   b = *B++;
+      "ld   %[b], %a[Z]+"    "\n" //
+      "movw %[B], %[Z]"      "\n" //
+      "movw %[Z], %[C]"      "\n" //   c = *C++;
+      "ld   %[c], %a[Z]+"    "\n" //
+      "movw %[C], %[Z]"      "\n" //
+      "movw %[Z], %[D]"      "\n" //   d = *D++;
+      "ld   %[d], %a[Z]+"    "\n" //
+      "movw %[D], %[Z]"      "\n" //
+      "ldi  %[m], 8"         "\n" //   m = 8;
+    "%=1:"                   "\n" //   do {
+      "mov  %[z], %[w]"      "\n" //     z = w;
+      "bst  %[a], 7"         "\n" //     z |= a >> 7;
+      "bld  %[z], 0"         "\n" //
+      "bst  %[b], 7"         "\n" //     z |= b >> 7 << 1;
+      "bld  %[z], 1"         "\n" //
+      "bst  %[c], 7"         "\n" //     z |= c >> 7 << 2;
+      "bld  %[z], 2"         "\n" //
+      "bst  %[d], 7"         "\n" //     z |= d >> 7 << 3;
+      "bld  %[z], 3"         "\n" //
+      "out  %[P], %[z]"      "\n" //     VPORTD.OUT = z;
+      "lsl  %[a]"            "\n" //     a <<= 1; // let the data lines settle
+      "lsl  %[b]"            "\n" //     b <<= 1; // before raising the clock
+      "ori  %[z], 0x10"      "\n" //
+      "out  %[P], %[z]"      "\n" //     VPORTD.OUT = z | 0x10;
+      "lsl  %[c]"            "\n" //     c <<= 1;
+      "lsl  %[d]"            "\n" //     d <<= 1;
+      "dec  %[m]"            "\n" //   } while (--m);
+      "brne %=1b"            "\n" //
+      "sbiw %[n], 1"         "\n" // } while (--n);
+      "brne %=0b"            "\n" //
+      "out  %[P], %[w]"      "\n" // VPORTD.OUT = w;
+      "rjmp .+0"             "\n" // total 34.4us per 4 pixels (950ns per bit + 1000ns more between bytes @ 20MHz)
+      // Earlyclobber: `w` is still read after all of these have been written.
+      : [a]  "=&r" (a)
+      , [b]  "=&r" (b)
+      , [c]  "=&r" (c)
+      , [d]  "=&r" (d)
+      , [m]  "=&a" (m)
+      , [z]  "=&d" (z)
+      , [Z]  "=&z" (Z)
+      , [A]  "+r"  (A)
+      , [B]  "+r"  (B)
+      , [C]  "+r"  (C)
+      , [D]  "+r"  (D)
+      , [n]  "+w"  (n)
+      : [P]  "I"   (_SFR_IO_ADDR(VPORTD_OUT))
+      , [w]  "r"   (w)
+    );
+    do PORTD.OUTSET = 0x10,
+       PORTD.OUTCLR = 0x10; while (--e);
+#endif
+  }
+
+private:
+  uint16_t endTime = 0;
+};
+
+static LEDStripQuad strips;
+// For when strips 0 and 1 are not the same kind as strips 2 and 3.
+static LEDStripPair strip01{17, 16, 20};
+static LEDStripPair strip23{15, 14, 20};
+#elif AMBILIGHT_HARDWARE_SPI
+// Shifts out APA102-like strip 0 through SPI0 (data on pin 11, clock on 13) and strip 1
+// through USART1 in master SPI mode (data on pin 1, clock on 4), both at 5MHz. Feeding
+// them from interrupts would take longer than shifting the bytes out, so they're polled,
+// but with interrupts enabled, so serial data is still received. If that delays a byte,
+// the clock simply pauses.
+struct LEDStripPeripherals {
+  void show(const uint8_t* A, const uint8_t* B, size_t n) {
+    if (!n) return;
+    // Same as `LEDStripPair::showSPI`, in bytes: 32 zero bits of start frame, then at the
+    // end at least one clock per 2 LEDs.
+    size_t e = n > 256 ? (n + 63) / 64 : 4;
+#ifndef __AVR__
+    emulateShow(4 + n + e, 1.6);
+#else
+    PORTMUX.TWISPIROUTEA = PORTMUX_SPI0_ALT2_gc;
+    PORTMUX.USARTROUTEA = (PORTMUX.USARTROUTEA & ~PORTMUX_USART1_gm) | PORTMUX_USART1_ALT1_gc;
+    PORTE.DIRSET = PIN0_bm | PIN2_bm;
+    PORTC.DIRSET = PIN4_bm | PIN6_bm;
+    SPI0.CTRLB = SPI_BUFEN_bm | SPI_SSD_bm | SPI_MODE_0_gc;
+    SPI0.CTRLA = SPI_MASTER_bm | SPI_PRESC_DIV4_gc | SPI_ENABLE_bm;
+    USART1.BAUD = 2 << 6; // F_CPU / (2 * 2)
+    USART1.CTRLC = USART_CMODE_MSPI_gc;
+    USART1.CTRLB = USART_TXEN_bm;
+    transfer(nullptr, nullptr, 4);
+    transfer(A, B, n);
+    transfer(nullptr, nullptr, e);
+    while (!(SPI0.INTFLAGS & SPI_TXCIF_bm) || !(USART1.STATUS & USART_TXCIF_bm));
+    // Give the pins back to the timed output.
+    SPI0.CTRLA = 0;
+    USART1.CTRLB = 0;
+#endif
+  }
+
+private:
+#ifdef __AVR__
+  // Send `n` bytes from `A` and `B` (or zeros if null) at the same time. The "transmit
+  // complete" flags are cleared after each write so that they're only set at the end.
+  static void transfer(const uint8_t* A, const uint8_t* B, size_t n) {
+    for (size_t i = 0, j = 0; i < n || j < n; ) {
+      if (i < n && (SPI0.INTFLAGS & SPI_DREIF_bm))
+        SPI0.DATA = A ? A[i] : 0, SPI0.INTFLAGS = SPI_TXCIF_bm, i++;
+      if (j < n && (USART1.STATUS & USART_DREIF_bm))
+        USART1.TXDATAL = B ? B[j] : 0, USART1.STATUS = USART_TXCIF_bm, j++;
+    }
+  }
+#endif
+};
+
+static LEDStripPeripherals strip01;
+static LEDStripPair strip0{11, 11, -1};
+static LEDStripPair strip1{ 1,  1, -1};
+static LEDStripPair strip23{ 9, 10,  5};
+#else
 static LEDStripPair strip01{ 9, 10,  5};
 static LEDStripPair strip23{11, 12, 13};
-static uint8_t data[4][AMBILIGHT_CHUNKS_PER_STRIP][AMBILIGHT_SERIAL_CHUNK];
+#endif
+
+// Refresh strips 0 and 1 with `nAB` bytes from `A` and `B`, and strips 2 and 3 with `nCD`
+// bytes from `C` and `D`. `spiAB` and `spiCD` say which kind each pair is.
+static void show(const uint8_t* A, const uint8_t* B, size_t nAB, bool spiAB,
+                 const uint8_t* C, const uint8_t* D, size_t nCD, bool spiCD) {
+#if AMBILIGHT_OUTPUT_LANES == 4
+  if (spiAB == spiCD) {
+    strips.show(A, B, C, D, nAB > nCD ? nAB : nCD, spiAB);
+    return;
+  }
+  // The SPI strips ignore the timed data because there's no clock; the WS281x strips
+  // see no data at all while the SPI pair is being refreshed.
+  strip01.show(A, B, nAB, spiAB);
+  strip23.show(C, D, nCD, spiCD);
+#elif AMBILIGHT_HARDWARE_SPI
+  if (spiAB)
+    strip01.show(A, B, nAB);
+  else
+    strip0.show(A, A, nAB, false),
+    strip1.show(B, B, nAB, false);
+  strip23.show(C, D, nCD, spiCD);
+#else
+  strip01.show(A, B, nAB, spiAB);
+  strip23.show(C, D, nCD, spiCD);
+#endif
+}
+
+static uint8_t data[4][AMBILIGHT_CHUNKS_PER_STRIP * AMBILIGHT_SERIAL_CHUNK];
 static bool valid = false;
+// Which pairs are SPI strips when refreshing with request 248, as set by request 249.
+static uint8_t kinds = 0;
+// Size of the chunks with 16-bit indices, as set by request 250.
+static uint8_t chunkSize = AMBILIGHT_SERIAL_CHUNK;
 
 static void fallbackPattern() {
   memset(data, 0, sizeof(data));
   // data = {SPI 0/1, SPI 2/3, WS281x 0/1, WS281x 2/3}
-  for (auto& chunk : data[0]) for (size_t i = 0; i < AMBILIGHT_SERIAL_CHUNK; i += 4) chunk[i] = 0xE0;
-  for (auto& chunk : data[1]) for (size_t i = 0; i < AMBILIGHT_SERIAL_CHUNK; i += 4) chunk[i] = 0xE0;
-  data[0][0][0] = data[1][0][0] /* APA102 Y */ = 0xFF;
-  data[0][0][3] = data[1][0][3] /* APA102 R */ = data[2][0][1] = data[3][0][1] /* WS2812B R */ = 10;
+  for (size_t i = 0; i < sizeof(data[0]); i += 4) data[0][i] = data[1][i] = 0xE0;
+  data[0][0] = data[1][0] /* APA102 Y */ = 0xFF;
+  data[0][3] = data[1][3] /* APA102 R */ = data[2][1] = data[3][1] /* WS2812B R */ = 10;
   // Show using SPI first because the timed data will be ignored by SPI strips.
-  for (int i = 0; i < 4; i++) (i & 1 ? strip23 : strip01).show(data[i][0], data[i][0], sizeof(data[i]), i < 2);
+  show(data[0], data[0], sizeof(data[0]), true,  data[1], data[1], sizeof(data[1]), true);
+  show(data[2], data[2], sizeof(data[2]), false, data[3], data[3], sizeof(data[3]), false);
   valid = false;
 }
 
 void setup() {
   fallbackPattern();
-  Serial.begin(AMBILIGHT_SERIAL_BAUD_RATE);
-  while (!Serial);
+  beginSerial();
+}
+
+// `ns` is the number of bytes to refresh on each pair of strips; bits of `spi` are
+// set for pairs of SPI strips, as in request 249.
+static void show(const uint16_t (&ns)[2], uint8_t spi) {
+  show(data[0], data[1], ns[0], spi & 1, data[2], data[3], ns[1], spi & 2);
+}
+
+// Make sure the first `end` bytes of a strip are refreshed. Rounded up to a whole
+// chunk, which is also a whole number of LEDs.
+static void extend(uint16_t (&ns)[2], uint8_t strip, uint16_t end) {
+  end = (end + AMBILIGHT_SERIAL_CHUNK - 1) / AMBILIGHT_SERIAL_CHUNK * AMBILIGHT_SERIAL_CHUNK;
+  if (ns[strip / 2] < end)
+    ns[strip / 2] = end < sizeof(data[0]) ? end : sizeof(data[0]);
+}
+
+static bool readChunk(uint8_t index, uint16_t (&ns)[2]) {
+  uint8_t i = index % 4;
+  uint8_t j = index / 4;
+  uint8_t* out = data[i] + j * AMBILIGHT_SERIAL_CHUNK;
+  if (index >= 248 || j >= AMBILIGHT_CHUNKS_PER_STRIP || readBytes(out, AMBILIGHT_SERIAL_CHUNK) != AMBILIGHT_SERIAL_CHUNK)
+    return false;
+  extend(ns, i, (j + 1) * AMBILIGHT_SERIAL_CHUNK);
+  return true;
+}
+
+static uint8_t s1;
+static uint8_t s2;
+
+static bool readSummed(uint8_t* p, size_t n) {
+  if (readBytes(p, n) != n)
+    return false;
+  while (n--) s1 += *p++, s2 += s1;
+  return true;
+}
+
+static bool readPatch(bool fill, uint16_t (&ns)[2]) {
+  // strip, offset low, offset high, length[, period]
+  uint8_t h[5];
+  if (!readSummed(h, fill ? 5 : 4))
+    return false;
+  uint16_t offset = h[1] | h[2] << 8;
+  if (h[0] >= 4 || offset + h[3] > sizeof(data[h[0]]) || (fill && (h[4] < 1 || h[4] > 4 || h[4] > h[3])))
+    return false;
+  uint8_t* out = data[h[0]] + offset;
+  if (!readSummed(out, fill ? h[4] : h[3]))
+    return false;
+  // Copying forward from `period` bytes back repeats the pattern.
+  for (uint8_t i = fill ? h[4] : h[3]; i < h[3]; i++)
+    out[i] = out[i - h[4]];
+  extend(ns, h[0], offset + h[3]);
+  return true;
+}
+
+static bool readLongChunk(uint16_t (&ns)[2]) {
+  // strip, index low, index high
+  uint8_t h[3];
+  if (!readSummed(h, 3))
+    return false;
+  uint32_t offset = (uint32_t)(h[1] | h[2] << 8) * chunkSize;
+  if (h[0] >= 4 || offset + chunkSize > sizeof(data[h[0]]) || !readSummed(data[h[0]] + offset, chunkSize))
+    return false;
+  extend(ns, h[0], offset + chunkSize);
+  return true;
+}
+
+// Handle request 250 (see above).
+static bool setChunkSize() {
+  uint8_t size;
+  if (readBytes(&size, 1) != 1)
+    return false;
+  // Same limits as AMBILIGHT_SERIAL_CHUNK: a whole number of 3- and 4-byte LEDs, and less
+  // than 63 bytes.
+  chunkSize = size && size < 63 && size % 12 == 0 ? size : AMBILIGHT_SERIAL_CHUNK;
+  return writeByte(chunkSize) && writeByte(sizeof(data[0]) & 0xFF) && writeByte(sizeof(data[0]) >> 8);
+}
+
+// Read chunks and patches until the end of a stream, and return the final request
+// (248, 254, or 255) if the checksum matches or 0 if it doesn't.
+static uint8_t readStream(uint16_t (&ns)[2]) {
+  uint8_t index, check[2];
+  s1 = s2 = 0;
+  while (readSummed(&index, 1)) {
+    if (index == 248 || index == 254 || index == 255)
+      return readBytes(check, 2) == 2 && check[0] == s1 && check[1] == s2 ? index : 0;
+    if (index == 252 || index == 253) {
+      if (!readPatch(index == 252, ns))
+        return 0;
+      continue;
+    }
+    if (index == 250) {
+      if (!readLongChunk(ns))
+        return 0;
+      continue;
+    }
+    if (!readChunk(index, ns))
+      return 0;
+    for (uint8_t i = 0; i < AMBILIGHT_SERIAL_CHUNK; i++)
+      s1 += data[index % 4][index / 4 * AMBILIGHT_SERIAL_CHUNK + i], s2 += s1;
+  }
+  return 0;
 }
 
 void loop() {
-  for (uint8_t i = 1; !Serial.find("<RGBDATA"); i++)
+  for (uint8_t i = 1; !find("<RGBDATA"); i++)
     if (i % 4 /* seconds */ == 0)
       fallbackPattern();
 
   uint8_t index;
-  uint8_t ns[] = {0, 0};
-  while (Serial.write(valid ? '>' : '<') && Serial.readBytes(&index, 1) == 1) {
+  uint16_t ns[] = {0, 0};
+  // The host may have sent a stream of changes before seeing the response, in which
+  // case they are relative to the wrong frame.
+  bool known = valid;
+  while (writeByte(valid ? '>' : '<') && readBytes(&index, 1) == 1) {
     valid = true;
-    if (index == 254 || index == 255) {
-      strip01.show(data[0][0], data[1][0], sizeof(data[0][0]) * ns[0], index == 254);
-      strip23.show(data[2][0], data[3][0], sizeof(data[2][0]) * ns[1], index == 254);
-      Serial.write('>');
+    if (index == 253)
+      continue;
+    if (index == 250) {
+      if (!setChunkSize())
+        break;
+      continue;
+    }
+    if (index == 249) {
+      if (readBytes(&kinds, 1) != 1)
+        break;
+      continue;
+    }
+    if (index == 251 || index == 252) {
+      bool complete = index == 251;
+      if (!(index = readStream(ns)) || !(known || complete)) {
+        // Some of the LEDs have garbage in them now, so don't show anything until the
+        // next complete frame.
+        valid = false;
+        writeByte('<');
+        return;
+      }
+    }
+    if (index == 248 || index == 254 || index == 255) {
+      uint8_t spi = index == 248 ? kinds : index == 254 ? 3 : 0;
+      // Timed output only lets the USART interrupt run once per byte, which is less often
+      // than bytes arrive, so the host must not send anything until it's done.
+      bool timed = (ns[0] && !(spi & 1)) || (ns[1] && !(spi & 2));
+      if (!timed)
+        writeByte('>');
+      show(ns, spi);
+      if (timed)
+        writeByte('>');
       return;
     }
-
-    uint8_t i = index % 4;
-    uint8_t j = index / 4;
-    if (j >= AMBILIGHT_CHUNKS_PER_STRIP || Serial.readBytes(data[i][j], sizeof(data[i][j])) != sizeof(data[i][j]))
+    if (!readChunk(index, ns))
       break;
-    if (ns[i / 2] <= j)
-      ns[i / 2] = j + 1;
   }
   fallbackPattern();
 }
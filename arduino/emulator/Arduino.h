@@ -0,0 +1,66 @@
+#pragma once
+
+// Just enough of the Arduino core for `arduino.ino` to build on a POSIX host.
+// Everything here is implemented in emulator.cpp.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define F_CPU 20000000UL
+
+#define PIN4_bm 0x10
+#define USART_RXCIE_bm 0x80
+#define USART_RXEN_bm 0x80
+#define USART_TXEN_bm 0x40
+#define USART_DREIF_bm 0x20
+#define PORTMUX_USART3_gm 0xC0
+#define PORTMUX_USART3_ALT1_gc 0x40
+
+// Interrupt handlers are called from another thread, which blocks while "interrupts"
+// are disabled on the main one.
+#define ISR(vector) void vector()
+void USART3_RXC_vect();
+void noInterrupts();
+void interrupts();
+
+unsigned long micros();
+unsigned long millis();
+void yield();
+
+struct PORT_struct {
+  uint8_t DIR, DIRSET, DIRCLR, DIRTGL, OUT, OUTSET, OUTCLR, OUTTGL;
+};
+
+// PORTA..PORTF, in that order, so that `&PORTA + digital_pin_to_port[pin]` works.
+extern PORT_struct emulatedPorts[6];
+#define PORTA (emulatedPorts[0])
+#define PORTB (emulatedPorts[1])
+#define PORTD (emulatedPorts[3])
+
+// Writes to TXDATAL are sent to the terminal; RXDATAL is set before calling the
+// receive interrupt handler.
+struct emulated_txdata {
+  void operator=(uint8_t c);
+};
+
+struct USART_struct {
+  uint8_t RXDATAL;
+  emulated_txdata TXDATAL;
+  uint8_t STATUS = USART_DREIF_bm;
+  uint8_t CTRLA, CTRLB;
+  uint16_t BAUD;
+};
+
+extern USART_struct USART3;
+
+struct PORTMUX_struct {
+  uint8_t EVSYSROUTEA, CCLROUTEA, USARTROUTEA, TWISPIROUTEA, TCAROUTEA, TCBROUTEA;
+};
+
+extern PORTMUX_struct PORTMUX;
+
+// Called instead of shifting out `n` bytes to each strip at `byteTime` microseconds per
+// byte. Takes as long as the real thing would. If `masked` is set, interrupts are only
+// enabled for a moment once per byte, so received bytes are handled at most that often.
+void emulateShow(size_t n, float byteTime, bool masked = false);
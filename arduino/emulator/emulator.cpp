@@ -0,0 +1,200 @@
+// Runs arduino.ino on a POSIX host, talking to the app through a pseudo-terminal instead
+// of a USB serial port. Timing follows the real thing: bytes are received no faster than
+// AMBILIGHT_SERIAL_BAUD_RATE allows (10 bits each), and refreshing the strips takes as
+// long as the bit-banged output would at 20MHz. Reception is done by another thread
+// that calls the USART interrupt handler. During SPI refreshes it runs as soon as a byte
+// arrives; during timed ones, only in the window the output loop opens once per byte,
+// and bytes that arrive while the USART's 2-byte FIFO is full are lost.
+//
+//     arduinoemu
+//
+// (Build with `-DAMBILIGHT_OUTPUT_LANES=4` or `-DAMBILIGHT_HARDWARE_SPI=1` to emulate
+// the other output modes.)
+//
+// Prints the name of the terminal to connect to (e.g. `ambilightd --port /dev/pts/3`),
+// then, once per second, how many times the LEDs were refreshed (once per group of strips
+// driven at the same time), how much of the time that took, how many bytes were received
+// and lost to overruns, and how many times a complete frame had to be requested because
+// the last one was lost or never sent.
+
+#include "Arduino.h"
+
+#include "../arduino.ino"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <iterator>
+#include <mutex>
+#include <thread>
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <unistd.h>
+
+using emulator_clock = std::chrono::steady_clock;
+
+PORT_struct emulatedPorts[6];
+USART_struct USART3;
+PORTMUX_struct PORTMUX;
+
+static int terminal = -1;
+static const auto started = emulator_clock::now();
+static std::mutex interruptLock;
+
+static std::atomic<uint64_t> refreshes{0};
+static std::atomic<uint64_t> refreshTime{0}; // in microseconds
+static std::atomic<uint64_t> received{0};
+static std::atomic<uint64_t> resyncs{0};
+static std::atomic<uint64_t> overruns{0};
+
+// Roughly how long the USART interrupt handler takes, including entry and exit. When
+// it runs during a timed refresh, the rest of the refresh is delayed by that much.
+static const auto interruptTime = std::chrono::nanoseconds(2500);
+
+// The last refresh that had interrupts disabled: when it started, when it will end, and
+// when and how often it enables them.
+static std::mutex showLock;
+static emulator_clock::time_point showStart;
+static emulator_clock::time_point showEnd;
+static emulator_clock::time_point showNext;
+static emulator_clock::duration showWindow{0};
+
+unsigned long micros() {
+  return (unsigned long)std::chrono::duration_cast<std::chrono::microseconds>(emulator_clock::now() - started).count();
+}
+
+unsigned long millis() {
+  return micros() / 1000;
+}
+
+void yield() {
+  // Don't spin a whole core while waiting for data.
+  std::this_thread::sleep_for(std::chrono::microseconds(10));
+}
+
+void noInterrupts() {
+  interruptLock.lock();
+}
+
+void interrupts() {
+  interruptLock.unlock();
+}
+
+void emulated_txdata::operator=(uint8_t c) {
+  resyncs += c == '<';
+  if (::write(terminal, &c, 1) != 1)
+    perror("write");
+}
+
+void emulateShow(size_t n, float byteTime, bool masked) {
+  auto us = (uint64_t)(n * byteTime);
+  auto start = emulator_clock::now();
+  auto end = start + std::chrono::microseconds(us);
+  if (masked) {
+    std::lock_guard<std::mutex> lk(showLock);
+    showStart = showNext = start;
+    showEnd = end;
+    showWindow = std::chrono::nanoseconds((uint64_t)(byteTime * 1000));
+  }
+  // The interrupt handler may delay the end while this is waiting for it.
+  while (end > emulator_clock::now()) {
+    std::this_thread::sleep_until(end);
+    std::lock_guard<std::mutex> lk(showLock);
+    if (masked)
+      end = showEnd;
+  }
+  us = (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+  refreshes++;
+  refreshTime += us;
+}
+
+static void receiveThread() {
+  uint8_t buffer[256];
+  // When the last byte would have finished arriving at the USART, and when the interrupt
+  // handler took the last two bytes out of its FIFO.
+  auto wire = emulator_clock::now();
+  emulator_clock::time_point handled[2] = {wire, wire};
+  for (ssize_t r; (r = ::read(terminal, buffer, sizeof(buffer))) > 0; ) {
+    // The data was sent no later than now, so it can arrive no later than 10 bits after
+    // whatever was before it. A byte is never handed to the interrupt handler early, but
+    // may be a bit late, as sleeping is not very precise.
+    auto sent = emulator_clock::now();
+    for (ssize_t i = 0; i < r; i++) {
+      wire = std::max(wire, sent) + std::chrono::microseconds(10 * 1000000ull / AMBILIGHT_SERIAL_BAUD_RATE);
+      if (wire > emulator_clock::now())
+        std::this_thread::sleep_until(wire);
+      if (handled[0] > wire) {
+        // Both bytes before this one are still in the FIFO.
+        overruns++;
+        continue;
+      }
+      auto at = std::max(wire, handled[1]);
+      {
+        std::lock_guard<std::mutex> lk(showLock);
+        if (at >= showStart && at < showEnd) {
+          // Wait for the next window; if there is one before the end, the handler delays
+          // everything after it.
+          if (at > showNext)
+            showNext += (at - showNext + showWindow - std::chrono::nanoseconds(1)) / showWindow * showWindow;
+          at = std::min(showNext, showEnd);
+          if (at < showEnd) {
+            showNext += showWindow + interruptTime;
+            showEnd += interruptTime;
+          }
+        }
+      }
+      handled[0] = handled[1];
+      handled[1] = at;
+      if (at > emulator_clock::now())
+        std::this_thread::sleep_until(at);
+      std::lock_guard<std::mutex> lk(interruptLock);
+      USART3.RXDATAL = buffer[i];
+      USART3_RXC_vect();
+    }
+    received += r;
+  }
+  perror("read");
+  exit(1);
+}
+
+int main() {
+  terminal = posix_openpt(O_RDWR | O_NOCTTY);
+  if (terminal < 0 || grantpt(terminal) || unlockpt(terminal)) {
+    perror("posix_openpt");
+    return 1;
+  }
+  // Keep the other end open too, so that the terminal survives the app reconnecting,
+  // and make it raw so that nothing is echoed or translated before the app sets it up.
+  int other = open(ptsname(terminal), O_RDWR | O_NOCTTY);
+  termios tty;
+  if (other < 0 || tcgetattr(other, &tty)) {
+    perror(ptsname(terminal));
+    return 1;
+  }
+  cfmakeraw(&tty);
+  tcsetattr(other, TCSANOW, &tty);
+  printf("%s\n", ptsname(terminal));
+  fflush(stdout);
+
+  std::thread{receiveThread}.detach();
+  std::thread{[] {
+    uint64_t last[5] = {};
+    for (;;) {
+      std::this_thread::sleep_for(std::chrono::seconds(1));
+      uint64_t now[5] = {refreshes, refreshTime, received, overruns, resyncs};
+      printf("%llu refreshes (%.1f%% busy), %llu B/s, %llu overruns, %llu resyncs\n",
+             (unsigned long long)(now[0] - last[0]), (now[1] - last[1]) / 1e4,
+             (unsigned long long)(now[2] - last[2]), (unsigned long long)(now[3] - last[3]),
+             (unsigned long long)(now[4] - last[4]));
+      fflush(stdout);
+      std::copy(std::begin(now), std::end(now), std::begin(last));
+    }
+  }}.detach();
+
+  setup();
+  for (;;)
+    loop();
+}
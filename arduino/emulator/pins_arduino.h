@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stdint.h>
+
+// Arduino Nano Every. Ports are numbered from PORTA = 0.
+static const uint8_t digital_pin_to_port[] = {
+  2, 2, 0, 5, 2, 1, 5, 0, 4, 1, 1, 4, 4, 4, 3, 3, 3, 3, 5, 5, 3, 3,
+};
+
+static const uint8_t digital_pin_to_bit_position[] = {
+  5, 4, 0, 5, 6, 2, 4, 1, 3, 0, 1, 0, 1, 2, 3, 2, 1, 0, 2, 3, 4, 5,
+};
@@ -14,6 +14,12 @@ struct IAudioCapturer {
     //
     // TODO define the range of amplitudes.
     virtual util::span<const float> next(uint32_t timeout = 200) = 0;
+
+    // For capturers that queue samples between the device and the analysis: the number of
+    // times samples were lost because the analysis fell behind or the device glitched, and
+    // the number of frames currently waiting to be analyzed.
+    virtual uint64_t overruns() const { return 0; }
+    virtual size_t queued() const { return 0; }
 };
 
 struct IVideoCapturer {
@@ -24,9 +30,57 @@ struct IVideoCapturer {
     virtual util::span<const FLOATX4> next(uint32_t timeout = 500) = 0;
 };
 
+// A rectangle of pixels, not including the right and bottom edges.
+struct frame_rect {
+    uint32_t left;
+    uint32_t top;
+    uint32_t right;
+    uint32_t bottom;
+};
+
+// An uncompressed 8-bit BGRA image, e.g. the contents of a screen.
+struct bgra_frame {
+    const uint8_t* data = nullptr;
+    uint32_t width = 0;
+    uint32_t height = 0;
+    size_t pitch = 0;
+    // Same decomposition of display rotation as in `captureScreen`: rotate by 90 degrees
+    // clockwise, then maybe flip both axes.
+    bool rotate = false;
+    bool mirror = false;
+    // Areas that may have changed since the previous frame from the same source (including
+    // destinations of moves). If empty, assume the entire frame has changed.
+    util::span<const frame_rect> dirty;
+
+    explicit operator bool() const { return data; }
+};
+
+struct IFrameSource {
+    virtual ~IFrameSource() = default;
+    // Grab a new frame, blocking for up to the specified number of milliseconds. If nothing
+    // has changed since the last call, return an empty frame instead. The data must stay
+    // valid until the next call.
+    virtual bgra_frame next(uint32_t timeout = 500) = 0;
+};
+
 // Create a new video capturer that takes an image of the screen, downscales it
 // to the specified size, then blurs it a bit.
 std::unique_ptr<IVideoCapturer> captureScreen(uint32_t id, uint32_t w, uint32_t h);
 
+// Create a new video capturer that downscales and blurs frames from a source on the CPU,
+// producing the same result as `captureScreen` without a GPU.
+std::unique_ptr<IVideoCapturer> captureFrames(std::unique_ptr<IFrameSource> source, uint32_t w, uint32_t h);
+
 // Create a new audio capturer that uses a WASAPI loopback on a default output device.
 std::unique_ptr<IAudioCapturer> captureDefaultAudioOutput();
+
+// Create a video capturer that renders a moving test image at a fixed frame rate
+// instead of looking at an actual display.
+std::unique_ptr<IVideoCapturer> captureSyntheticVideo(uint32_t w, uint32_t h, uint32_t fps);
+
+// Create an audio capturer that analyzes a generated signal in real time instead
+// of listening to an actual device.
+std::unique_ptr<IAudioCapturer> captureSyntheticAudio(uint32_t sampleRate);
+
+// Create a frame source that renders a moving test image of the specified size at a fixed rate.
+std::unique_ptr<IFrameSource> synthesizeFrames(uint32_t width, uint32_t height, uint32_t fps);
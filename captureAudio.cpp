@@ -1,6 +1,7 @@
 #include "capture.h"
-#include "kiss_fft.h"
 #include "defer.hpp"
+#include "spectrum.h"
+#include "spsc.hpp"
 #include "dxui/winapi.hpp"
 
 #include <Audioclient.h>
@@ -8,50 +9,145 @@
 
 #include <algorithm>
 #include <atomic>
+#include <exception>
+#include <thread>
 #include <vector>
 
-// The minimal frequency resolved by DFT.
-#define DFT_RESOLUTION 25
+// How much captured audio, in milliseconds, may wait for analysis before new buffers are
+// dropped. Analysis normally keeps up within one buffer; this only absorbs stalls.
+#define AUDIO_QUEUE_MS 500
 
-// The number of DFT runs per unit of resolution (i.e. the update frequency
-// is the product of this and DFT_RESOLUTION).
-#define DFT_RUNS_PER_FILL 4
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define AUDIO_SSE2 1
+#endif
 
-// EWMA coefficients for merging consecutive updates. Greater = smoother.
-#define DFT_EWMA_RISE 0.50f
-#define DFT_EWMA_DROP 0.96f
+// Converts a buffer of interleaved frames into one plane of floats from -1 to 1 for each of
+// the first two channels (a mono stream is copied into both) according to the device's format.
+struct AudioSampleReader {
+    void operator()(const BYTE* data, UINT32 frames, float* left, float* right) const {
+        read(data, frames, *this, left, right);
+    }
+
+    void (*read)(const BYTE* data, UINT32 frames, const AudioSampleReader& format, float* left, float* right);
+    UINT32 stride; // Bytes per frame.
+    UINT32 second; // Offset of the second channel's sample within a frame.
+    // Valid bits are the most significant ones, and the rest are not guaranteed to be zero;
+    // integer samples are ANDed with this after being moved into the top of an `INT32`.
+    INT32 mask;
+};
+
+// A 3-byte little-endian signed integer.
+struct INT24 { BYTE b[3]; };
+
+// Scale a sample aligned to the top of an `INT32` to [-1, 1].
+static const float int32Scale = 1.f / (256.f * 256.f * 256.f * 128.f);
 
-// Converts a binary audio sample into a floating-point number from 0 to 1
-// according to the device's wave format.
-using AudioSampleReader = float(BYTE*);
+static float readSample(const BYTE* at, INT32 mask, UINT8*)  { return (INT32)(((UINT32)at[0] << 24 & mask) ^ 0x80000000u) * int32Scale; }
+static float readSample(const BYTE* at, INT32 mask, INT16*)  { return (INT32)((UINT32)*(UINT16*)at << 16 & mask) * int32Scale; }
+static float readSample(const BYTE* at, INT32 mask, INT24*)  { return (INT32)(((UINT32)at[0] << 8 | (UINT32)at[1] << 16 | (UINT32)at[2] << 24) & mask) * int32Scale; }
+static float readSample(const BYTE* at, INT32 mask, INT32*)  { return (*(INT32*)at & mask) * int32Scale; }
+static float readSample(const BYTE* at, INT32 mask, float*)  { return *(float*)at; }
+static float readSample(const BYTE* at, INT32 mask, double*) { return (float)*(double*)at; }
 
-static AudioSampleReader* makeAudioSampleReader(WAVEFORMATEXTENSIBLE* pwfx) {
-    if (pwfx->SubFormat == KSDATAFORMAT_SUBTYPE_IEEE_FLOAT) switch (pwfx->Format.wBitsPerSample) {
-        case 32: return [](BYTE* at) -> float { return *(float*)at; };
-        case 64: return [](BYTE* at) -> float { return (float)*(double*)at; };
+// Convert as many interleaved stereo frames as possible several at a time, and return how many.
+// For the same input, these produce exactly the same output as `readSample`.
+template <typename T>
+static UINT32 readStereo(const BYTE* data, UINT32 frames, INT32 mask, float* left, float* right) { return 0; }
+
+#ifdef AUDIO_SSE2
+// Deinterleave 4 frames of two floats each.
+static void storeStereo(__m128 a, __m128 b, float* left, float* right) {
+    _mm_storeu_ps(left, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+    _mm_storeu_ps(right, _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+}
+
+template <>
+UINT32 readStereo<INT16>(const BYTE* data, UINT32 frames, INT32 mask, float* left, float* right) {
+    const __m128i m = _mm_set1_epi32(mask);
+    const __m128 scale = _mm_set1_ps(int32Scale);
+    UINT32 j = 0;
+    for (; j + 4 <= frames; j += 4) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(data + j * 4));
+        // At most 16 bits are valid, so the mask also clears the left channel from the right.
+        __m128i l = _mm_and_si128(_mm_slli_epi32(x, 16), m);
+        __m128i r = _mm_and_si128(x, m);
+        _mm_storeu_ps(left + j, _mm_mul_ps(_mm_cvtepi32_ps(l), scale));
+        _mm_storeu_ps(right + j, _mm_mul_ps(_mm_cvtepi32_ps(r), scale));
     }
-    if (pwfx->SubFormat == KSDATAFORMAT_SUBTYPE_PCM) switch (pwfx->Format.wBitsPerSample) {
-        // TODO there's `pwfx->Samples.wValidBitsPerSample` for scaling
-        case 8:  return [](BYTE* at) -> float { return *(INT8*)at / 256.f; };
-        case 16: return [](BYTE* at) -> float { return *(INT16*)at / (256.f * 256.f); };
-        case 24: return [](BYTE* at) -> float { return (*(INT32*)at & 0xFFFFFF) / (256.f * 256.f * 256.f); };
-        case 32: return [](BYTE* at) -> float { return *(INT32*)at / (256.f * 256.f * 256.f * 256.f); };
+    return j;
+}
+
+template <>
+UINT32 readStereo<INT32>(const BYTE* data, UINT32 frames, INT32 mask, float* left, float* right) {
+    const __m128i m = _mm_set1_epi32(mask);
+    const __m128 scale = _mm_set1_ps(int32Scale);
+    UINT32 j = 0;
+    for (; j + 4 <= frames; j += 4) {
+        __m128i a = _mm_and_si128(_mm_loadu_si128((const __m128i*)(data + j * 8)), m);
+        __m128i b = _mm_and_si128(_mm_loadu_si128((const __m128i*)(data + j * 8 + 16)), m);
+        storeStereo(_mm_mul_ps(_mm_cvtepi32_ps(a), scale), _mm_mul_ps(_mm_cvtepi32_ps(b), scale), left + j, right + j);
     }
-    // TODO A-law or mu-law format, probably.
-    return [](BYTE*) { return 0.0f; };
+    return j;
 }
 
-// Compute floor(log2(x)) + 1, i.e. the number of octaves in a range of x uniformly
-// distributed frequencies.
-static size_t log2fp1(DWORD i) {
-    return _BitScanReverse(&i, i) ? i + 1 : 0;
+template <>
+UINT32 readStereo<float>(const BYTE* data, UINT32 frames, INT32 mask, float* left, float* right) {
+    UINT32 j = 0;
+    for (; j + 4 <= frames; j += 4)
+        storeStereo(_mm_loadu_ps((const float*)(data + j * 8)), _mm_loadu_ps((const float*)(data + j * 8 + 16)), left + j, right + j);
+    return j;
 }
 
-struct fft_release {
-    void operator()(kiss_fftr_state* p) const {
-        kiss_fftr_free(p);
+template <>
+UINT32 readStereo<double>(const BYTE* data, UINT32 frames, INT32 mask, float* left, float* right) {
+    UINT32 j = 0;
+    for (; j + 4 <= frames; j += 4) {
+        const double* at = (const double*)(data + j * 16);
+        __m128 a = _mm_movelh_ps(_mm_cvtpd_ps(_mm_loadu_pd(at)), _mm_cvtpd_ps(_mm_loadu_pd(at + 2)));
+        __m128 b = _mm_movelh_ps(_mm_cvtpd_ps(_mm_loadu_pd(at + 4)), _mm_cvtpd_ps(_mm_loadu_pd(at + 6)));
+        storeStereo(a, b, left + j, right + j);
     }
-};
+    return j;
+}
+#endif
+
+template <typename T>
+static void readSamples(const BYTE* data, UINT32 frames, const AudioSampleReader& format, float* left, float* right) {
+    UINT32 j = 0;
+    if (format.stride == 2 * sizeof(T) && format.second == sizeof(T))
+        j = readStereo<T>(data, frames, format.mask, left, right);
+    for (data += j * format.stride; j < frames; j++, data += format.stride) {
+        left[j] = readSample(data, format.mask, (T*)nullptr);
+        right[j] = readSample(data + format.second, format.mask, (T*)nullptr);
+    }
+}
+
+static void readSilence(const BYTE*, UINT32 frames, const AudioSampleReader&, float* left, float* right) {
+    std::fill(left, left + frames, 0.f);
+    std::fill(right, right + frames, 0.f);
+}
+
+static AudioSampleReader makeAudioSampleReader(const WAVEFORMATEX* fmt) {
+    auto ext = fmt->wFormatTag == WAVE_FORMAT_EXTENSIBLE && fmt->cbSize >= 22 ? (const WAVEFORMATEXTENSIBLE*)fmt : nullptr;
+    bool isFloat = ext ? ext->SubFormat == KSDATAFORMAT_SUBTYPE_IEEE_FLOAT : fmt->wFormatTag == WAVE_FORMAT_IEEE_FLOAT;
+    bool isPCM = ext ? ext->SubFormat == KSDATAFORMAT_SUBTYPE_PCM : fmt->wFormatTag == WAVE_FORMAT_PCM;
+    UINT32 bits = fmt->wBitsPerSample;
+    UINT32 valid = ext && ext->Samples.wValidBitsPerSample ? std::min<UINT32>(ext->Samples.wValidBitsPerSample, bits) : bits;
+    AudioSampleReader r = {readSilence, fmt->nBlockAlign, fmt->nChannels > 1 ? bits / 8u : 0u, (INT32)(valid < 32 ? ~0u << (32 - valid) : ~0u)};
+    if (isFloat) switch (bits) {
+        case 32: r.read = readSamples<float>; break;
+        case 64: r.read = readSamples<double>; break;
+    }
+    if (isPCM) switch (bits) {
+        case 8:  r.read = readSamples<UINT8>; break;
+        case 16: r.read = readSamples<INT16>; break;
+        case 24: r.read = readSamples<INT24>; break;
+        case 32: r.read = readSamples<INT32>; break;
+    }
+    // TODO A-law or mu-law format, probably.
+    return r;
+}
 
 struct AudioOutputCapturer : IAudioCapturer, private IMMNotificationClient {
     AudioOutputCapturer() {
@@ -63,17 +159,10 @@ struct AudioOutputCapturer : IAudioCapturer, private IMMNotificationClient {
         winapi::throwOnFalse(audioClient->GetMixFormat(&formatPtr));
         DEFER { CoTaskMemFree(formatPtr); };
         format = *formatPtr;
-        reader = makeAudioSampleReader((WAVEFORMATEXTENSIBLE*)formatPtr);
-
-        // FFT works fastest when the sample count is a product of powers of 2, 3, and 5.
-        size_t n = kiss_fftr_next_fast_size_real(format.nSamplesPerSec / DFT_RESOLUTION);
-        for (auto& sv : samples)
-            sv.resize(n);
-        // Output range: [0, DFT_RESOLUTION, DFT_RESOLUTION*2, ..., Nyquist frequency].
-        fft.reset(kiss_fftr_alloc((int)n, 0, nullptr, nullptr));
-        fftBuffer.resize(n / 2 + 1);
-        // Discard 0 Hz, group the rest into octaves. First half is left channel, second half is right channel.
-        mapped.resize(log2fp1((DWORD)(n / 2)) * ARRAYSIZE(samples));
+        reader = makeAudioSampleReader(formatPtr);
+        analyzer = makeAudioAnalyzer(format.nSamplesPerSec);
+        // A whole number of frames, so that neither slice returned by `pop` splits one.
+        queue = std::make_unique<spsc_ring<BYTE>>((size_t)format.nSamplesPerSec * AUDIO_QUEUE_MS / 1000 * format.nBlockAlign);
 
         winapi::throwOnFalse(audioClient->Initialize(AUDCLNT_SHAREMODE_SHARED,
             AUDCLNT_STREAMFLAGS_LOOPBACK | AUDCLNT_STREAMFLAGS_EVENTCALLBACK, 0, 0, formatPtr, NULL));
@@ -81,65 +170,80 @@ struct AudioOutputCapturer : IAudioCapturer, private IMMNotificationClient {
         winapi::throwOnFalse(audioClient->Start());
         captureClient = COMi(IAudioCaptureClient, audioClient->GetService);
         winapi::throwOnFalse(enumerator->RegisterEndpointNotificationCallback(this));
+        drainer = std::thread{[this] { drain(); }};
     }
 
     ~AudioOutputCapturer() {
+        stopping = true;
+        SetEvent(readyEvent.get());
+        drainer.join();
         enumerator->UnregisterEndpointNotificationCallback(this);
         audioClient->Stop();
     }
 
     util::span<const float> next(uint32_t timeout) override {
-        BYTE* data;
-        UINT32 frames;
-        DWORD flags;
         bool haveUpdates = false;
-        if (WaitForSingleObject(readyEvent.get(), timeout) == WAIT_TIMEOUT) {
+        if (!queue->size() && WaitForSingleObject(queuedEvent.get(), timeout) == WAIT_TIMEOUT) {
             // Nothing is rendering to the stream, so insert an appropriate amount of silence.
             haveUpdates |= handleSound(nullptr, format.nSamplesPerSec * timeout / 1000);
-        } else do {
-            winapi::throwOnFalse(deviceChanged ? AUDCLNT_E_DEVICE_INVALIDATED : S_OK);
-            winapi::throwOnFalse(captureClient->GetBuffer(&data, &frames, &flags, NULL, NULL));
-            DEFER { captureClient->ReleaseBuffer(frames); };
-            haveUpdates |= handleSound(flags & AUDCLNT_BUFFERFLAGS_SILENT ? nullptr : data, frames);
-        } while (frames != 0);
-        return haveUpdates ? mapped : util::span<const float>{};
+        }
+        if (failed.load(std::memory_order_acquire))
+            std::rethrow_exception(failure);
+        // However much has piled up is analyzed in one go; it's the drain thread that must
+        // never be late, not this one.
+        queue->pop(queue->capacity(), [&](const BYTE* data, size_t size) {
+            // Silent buffers are queued as zeros; don't bother analyzing those.
+            bool silent = std::all_of(data, data + size, [](BYTE b) { return b == 0; });
+            haveUpdates |= handleSound(silent ? nullptr : data, (UINT32)(size / format.nBlockAlign));
+        });
+        return haveUpdates ? analyzer->octaves() : util::span<const float>{};
+    }
+
+    uint64_t overruns() const override {
+        return queue->overruns() + discontinuities;
+    }
+
+    size_t queued() const override {
+        return queue->size() / format.nBlockAlign;
     }
 
 private:
-    bool handleSound(BYTE* data, UINT32 frames) {
-        bool haveUpdates = false;
-        auto second = format.nChannels > 1 ? format.wBitsPerSample / 8 : 0;
-        auto shift = samples[0].size() / DFT_RUNS_PER_FILL;
-        for (size_t i = 0; frames--; i += format.nBlockAlign) {
-            samples[0][nextSample] = data ? reader(&data[i]) : 0;
-            samples[1][nextSample] = data ? reader(&data[i + second]) : 0;
-            if (++nextSample != samples[0].size())
-                continue; // Not enough for a DFT run yet.
-            if (data) {
-                size_t part = mapped.size() / ARRAYSIZE(samples);
-                for (size_t j = 0; j < ARRAYSIZE(samples); j++)
-                    mapTimeToLogFreq(samples[j], {&mapped[j * part], part});
-                haveUpdates = true;
-            } else if (std::any_of(mapped.begin(), mapped.end(), [](float c) { return c > 1e-5; })) {
-                for (auto& c : mapped) c *= DFT_EWMA_DROP;
-                haveUpdates = true;
+    // Move everything the device captures into `queue` as soon as it's available, doing no
+    // other work so that the device's own buffer never overflows. Runs on its own thread.
+    void drain() {
+        try {
+            while (!stopping) {
+                WaitForSingleObject(readyEvent.get(), INFINITE);
+                if (stopping)
+                    break;
+                winapi::throwOnFalse(deviceChanged ? AUDCLNT_E_DEVICE_INVALIDATED : S_OK);
+                BYTE* data;
+                UINT32 frames;
+                DWORD flags;
+                do {
+                    winapi::throwOnFalse(captureClient->GetBuffer(&data, &frames, &flags, NULL, NULL));
+                    DEFER { captureClient->ReleaseBuffer(frames); };
+                    if (flags & AUDCLNT_BUFFERFLAGS_DATA_DISCONTINUITY)
+                        discontinuities++;
+                    queue->push(flags & AUDCLNT_BUFFERFLAGS_SILENT ? nullptr : data, (size_t)frames * format.nBlockAlign);
+                } while (frames != 0);
+                SetEvent(queuedEvent.get());
             }
-            if (nextSample -= shift)
-                for (auto& sv : samples)
-                    std::copy(sv.begin() + shift, sv.end(), sv.begin());
+        } catch (const std::exception&) {
+            // Rethrown by the next call to `next`, after which this object is destroyed.
+            failure = std::current_exception();
+            failed.store(true, std::memory_order_release);
+            SetEvent(queuedEvent.get());
         }
-        return haveUpdates;
     }
 
-    void mapTimeToLogFreq(util::span<const kiss_fft_scalar> in, util::span<float> out) {
-        // assert(out.size() < in.size());
-        kiss_fftr(fft.get(), in.data(), fftBuffer.data());
-        for (size_t i = 1, j = 0; j < out.size(); j++) {
-            float m = 0;
-            for (size_t q = 1ull << j, d = 0; q-- && i < fftBuffer.size(); i++)
-                m += (sqrtf(fftBuffer[i].r * fftBuffer[i].r + fftBuffer[i].i * fftBuffer[i].i) - m) / ++d;
-            out[j] = (out[j] - m) * (m > out[j] ? DFT_EWMA_RISE : DFT_EWMA_DROP) + m;
-        }
+    bool handleSound(const BYTE* data, UINT32 frames) {
+        if (!data)
+            return analyzer->feed(nullptr, nullptr, frames);
+        for (auto& sv : samples)
+            sv.resize(frames);
+        reader(data, frames, samples[0].data(), samples[1].data());
+        return analyzer->feed(samples[0].data(), samples[1].data(), frames);
     }
 
     HRESULT OnDeviceStateChanged(LPCWSTR device, DWORD state) override { return S_OK; }
@@ -159,17 +263,21 @@ private:
 
 private:
     winapi::handle readyEvent{winapi::throwOnFalse(CreateEventEx(nullptr, nullptr, 0, EVENT_ALL_ACCESS))};
+    winapi::handle queuedEvent{winapi::throwOnFalse(CreateEventEx(nullptr, nullptr, 0, EVENT_ALL_ACCESS))};
     winapi::com_ptr<IMMDeviceEnumerator> enumerator;
     winapi::com_ptr<IAudioClient> audioClient;
     winapi::com_ptr<IAudioCaptureClient> captureClient;
-    std::unique_ptr<kiss_fftr_state, fft_release> fft;
-    std::vector<kiss_fft_scalar> samples[2];
-    std::vector<kiss_fft_cpx> fftBuffer;
-    std::vector<float> mapped;
+    std::unique_ptr<audio_analyzer> analyzer;
+    std::vector<float> samples[2];
+    std::unique_ptr<spsc_ring<BYTE>> queue;
     std::atomic<bool> deviceChanged{false};
-    AudioSampleReader* reader = nullptr;
+    std::atomic<bool> stopping{false};
+    std::atomic<bool> failed{false};
+    std::atomic<uint64_t> discontinuities{0};
+    std::exception_ptr failure;
+    AudioSampleReader reader = {};
     WAVEFORMATEX format;
-    size_t nextSample = 0;
+    std::thread drainer;
 };
 
 std::unique_ptr<IAudioCapturer> captureDefaultAudioOutput() {
@@ -0,0 +1,145 @@
+#include "capture.h"
+#include "spectrum.h"
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+using synthetic_clock = std::chrono::steady_clock;
+
+static const double pi = 3.14159265358979323846;
+
+// Wait until `deadline`, unless that is further away than `timeout` milliseconds.
+static bool sleepUntil(synthetic_clock::time_point deadline, uint32_t timeout) {
+    auto limit = synthetic_clock::now() + std::chrono::milliseconds(timeout);
+    std::this_thread::sleep_until(std::min(deadline, limit));
+    return deadline <= limit;
+}
+
+struct SyntheticVideoCapturer : IVideoCapturer {
+    SyntheticVideoCapturer(uint32_t w, uint32_t h, uint32_t fps)
+        : w(w), h(h), period(std::chrono::microseconds(1000000 / fps)), collected(w * h)
+    {}
+
+    util::span<const FLOATX4> next(uint32_t timeout) override {
+        if (!sleepUntil(deadline, timeout))
+            return {};
+        deadline += period;
+        // A rainbow rotating once every 10 seconds, darker towards the bottom of the screen.
+        float t = (float)(frame++ % 600) / 600;
+        for (uint32_t y = 0; y < h; y++)
+            for (uint32_t x = 0; x < w; x++) {
+                float hue = t + (float)x / w;
+                collected[y * w + x] = hsva2rgba({hue - (int)hue, 1, 1 - (float)y / h / 2, 1});
+            }
+        return collected;
+    }
+
+private:
+    uint32_t w;
+    uint32_t h;
+    synthetic_clock::duration period;
+    synthetic_clock::time_point deadline = synthetic_clock::now();
+    std::vector<FLOATX4> collected;
+    uint64_t frame = 0;
+};
+
+struct SyntheticFrameSource : IFrameSource {
+    SyntheticFrameSource(uint32_t width, uint32_t height, uint32_t fps)
+        : period(std::chrono::microseconds(1000000 / fps)), pixels(width * height * 4)
+    {
+        frame.data = pixels.data();
+        frame.width = width;
+        frame.height = height;
+        frame.pitch = width * 4;
+        fill({0, 0, width, height}, false);
+    }
+
+    bgra_frame next(uint32_t timeout) override {
+        if (!sleepUntil(deadline, timeout))
+            return {};
+        deadline += period;
+        // Static color bars with a white box bouncing around, like a small video playing
+        // on top of a desktop. Only the box's old and new positions change.
+        uint32_t t = (uint32_t)(index++ % 256);
+        uint32_t bw = frame.width / 8, bh = frame.height / 8;
+        uint32_t bx = (frame.width - bw) * t / 256;
+        uint32_t by = (frame.height - bh) * (t < 128 ? t : 255 - t) / 128;
+        dirty[0] = box;
+        dirty[1] = box = {bx, by, bx + bw, by + bh};
+        fill(dirty[0], false);
+        fill(dirty[1], true);
+        frame.dirty = {dirty, index > 1 ? 2u : 0u};
+        return frame;
+    }
+
+private:
+    void fill(frame_rect r, bool white) {
+        for (uint32_t y = r.top; y < r.bottom; y++) {
+            uint32_t channel = y / 64 % 3;
+            uint8_t* p = &pixels[y * frame.pitch + r.left * 4];
+            for (uint32_t x = r.left; x < r.right; x++, p += 4) {
+                p[0] = p[1] = p[2] = white ? 255 : 0;
+                p[channel] = white ? 255 : 192;
+                p[3] = 255;
+            }
+        }
+    }
+
+private:
+    synthetic_clock::duration period;
+    synthetic_clock::time_point deadline = synthetic_clock::now();
+    std::vector<uint8_t> pixels;
+    bgra_frame frame;
+    frame_rect box = {0, 0, 0, 0};
+    frame_rect dirty[2];
+    uint64_t index = 0;
+};
+
+struct SyntheticAudioCapturer : IAudioCapturer {
+    SyntheticAudioCapturer(uint32_t sampleRate)
+        : sampleRate(sampleRate), analyzer(makeAudioAnalyzer(sampleRate))
+    {
+        // Generate in 10ms blocks, roughly what a WASAPI loopback gives out.
+        for (auto& sv : samples)
+            sv.resize(sampleRate / 100);
+    }
+
+    util::span<const float> next(uint32_t timeout) override {
+        if (!sleepUntil(deadline, timeout))
+            return {};
+        deadline += std::chrono::milliseconds(10);
+        // A tone sweeping from 50 Hz to 12.8 kHz every 8 seconds, with a 2 Hz beat on top.
+        for (size_t i = 0; i < samples[0].size(); i++, sample++) {
+            double t = (double)sample / sampleRate;
+            double f = 50 * pow(2, fmod(t, 8));
+            phase = fmod(phase + 2 * pi * f / sampleRate, 2 * pi);
+            float beat = fmod(t, .5) < .1 ? 1.f : .2f;
+            samples[0][i] = (float)sin(phase) * beat;
+            samples[1][i] = (float)sin(phase) * (1.2f - beat);
+        }
+        return analyzer->feed(samples[0].data(), samples[1].data(), samples[0].size())
+             ? analyzer->octaves() : util::span<const float>{};
+    }
+
+private:
+    uint32_t sampleRate;
+    std::unique_ptr<audio_analyzer> analyzer;
+    std::vector<float> samples[2];
+    synthetic_clock::time_point deadline = synthetic_clock::now();
+    uint64_t sample = 0;
+    double phase = 0;
+};
+
+std::unique_ptr<IVideoCapturer> captureSyntheticVideo(uint32_t w, uint32_t h, uint32_t fps) {
+    return std::make_unique<SyntheticVideoCapturer>(w, h, fps);
+}
+
+std::unique_ptr<IAudioCapturer> captureSyntheticAudio(uint32_t sampleRate) {
+    return std::make_unique<SyntheticAudioCapturer>(sampleRate);
+}
+
+std::unique_ptr<IFrameSource> synthesizeFrames(uint32_t width, uint32_t height, uint32_t fps) {
+    return std::make_unique<SyntheticFrameSource>(width, height, fps);
+}
@@ -1,5 +1,6 @@
 #include "capture.h"
 #include "defer.hpp"
+#include "letterbox.h"
 #include "dxui/draw.hpp"
 
 #include <numeric>
@@ -43,6 +44,20 @@ struct ScreenCapturer : IVideoCapturer {
         targetDesc.BindFlags = D3D11_BIND_RENDER_TARGET | D3D11_BIND_SHADER_RESOURCE;
         targetDesc.MiscFlags = D3D11_RESOURCE_MISC_GENERATE_MIPS;
         complete = COMe(ID3D11Texture2D, res.raw()->CreateTexture2D, &targetDesc, nullptr);
+        crop = {0, 0, (LONG)targetDesc.Width, (LONG)targetDesc.Height};
+
+        // Black bars are detected on a small mip level of the full screen, which we
+        // have to generate anyway, so the extra cost is a tiny readback.
+        D3D11_TEXTURE2D_DESC barsDesc = targetDesc;
+        barsLevel = letterboxLevel(targetDesc.Width, targetDesc.Height);
+        barsDesc.Width = std::max(targetDesc.Width >> barsLevel, 1u);
+        barsDesc.Height = std::max(targetDesc.Height >> barsLevel, 1u);
+        barsDesc.MipLevels = 1;
+        barsDesc.Usage = D3D11_USAGE_STAGING;
+        barsDesc.BindFlags = 0;
+        barsDesc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
+        barsDesc.MiscFlags = 0;
+        barsReadTarget = COMe(ID3D11Texture2D, res.raw()->CreateTexture2D, &barsDesc, nullptr);
 
         targetDesc.Width = w;
         targetDesc.Height = h;
@@ -77,43 +92,45 @@ struct ScreenCapturer : IVideoCapturer {
         auto frame = resource.reinterpret<ID3D11Texture2D>();
         metadata.resize(frameInfo.TotalMetadataBufferSize);
 
-        D3D11_TEXTURE2D_DESC originalDesc;
         D3D11_TEXTURE2D_DESC rescaledDesc;
-        frame->GetDesc(&originalDesc);
         rescaled1->GetDesc(&rescaledDesc);
-        const RECT src = {0, 0, (LONG)originalDesc.Width, (LONG)originalDesc.Height};
+        // Only the part of the screen inside the black bars, if any, is sampled.
+        const RECT src = crop;
         const RECT dst = {0, 0, (LONG)rescaledDesc.Width, (LONG)rescaledDesc.Height};
         // These two values should normally be the same, but may differ if the display aspect ratio
         // is not the same as the LED rectangle aspect ratio.
-        const LONG rx = 10 * src.right / (rotate ? dst.bottom : dst.right);
-        const LONG ry = 10 * src.bottom / (rotate ? dst.right : dst.bottom);
+        const LONG rx = 10 * (src.right - src.left) / (rotate ? dst.bottom : dst.right);
+        const LONG ry = 10 * (src.bottom - src.top) / (rotate ? dst.right : dst.bottom);
         // The most expensive operation is `GenerateMips`, which cannot be clipped to update
         // a specific region only. At least we can discard the update entirely if it is
-        // in the middle of the screen.
+        // in the middle of the screen. (Anything outside the crop also touches its edges.)
+        auto touchesEdges = [&](const RECT& r) {
+            return src.left + rx >= r.left || rx + r.right  >= src.right
+                || src.top  + ry >= r.top  || ry + r.bottom >= src.bottom;
+        };
         for (const auto& move : meta<false>()) {
-            needUpdate |= rx >= move.DestinationRect.left || rx + move.DestinationRect.right  >= src.right
-                       || ry >= move.DestinationRect.top  || ry + move.DestinationRect.bottom >= src.bottom;
+            needUpdate |= touchesEdges(move.DestinationRect);
             res.copy(complete, complete, ui::moveRectTo(move.DestinationRect, move.SourcePoint),
                      {move.DestinationRect.left, move.DestinationRect.top});
         }
         for (const auto& dirty : meta<true>()) {
-            needUpdate |= rx >= dirty.left || rx + dirty.right  >= src.right
-                       || ry >= dirty.top  || ry + dirty.bottom >= src.bottom;
+            needUpdate |= touchesEdges(dirty);
             res.copy(complete, frame, dirty);
         }
         if (!needUpdate)
             return {};
 
         ui::vertex vs[] = {
-            QUADP(0, 0, dst.right, dst.bottom, 0, 0, 0, src.right, src.bottom),
-            QUADP(dst.right, dst.bottom, 0, 0, 0, 0, 0, src.right, src.bottom),
-            QUADPR(0, 0, dst.right, dst.bottom, 0, 0, 0, src.right, src.bottom),
-            QUADPR(dst.right, dst.bottom, 0, 0, 0, 0, 0, src.right, src.bottom),
+            QUADP(0, 0, dst.right, dst.bottom, 0, src.left, src.top, src.right, src.bottom),
+            QUADP(dst.right, dst.bottom, 0, 0, 0, src.left, src.top, src.right, src.bottom),
+            QUADPR(0, 0, dst.right, dst.bottom, 0, src.left, src.top, src.right, src.bottom),
+            QUADPR(dst.right, dst.bottom, 0, 0, 0, src.left, src.top, src.right, src.bottom),
         };
         ui::vertex vs2[] = {QUADP(0, 0, dst.right, dst.bottom, 0, 0, 0, dst.right, dst.bottom)};
         ui::vertex vs3[] = {QUADP(0, 0, dst.right, dst.bottom, 0, 0, 0, dst.right, dst.bottom)};
         vs2[0].clr.w = vs2[2].clr.w = vs2[3].clr.w = vs3[2].clr.w = vs3[3].clr.w = vs3[5].clr.w = 1;
         res.regenerateMipMaps(complete);
+        res.copyMipLevel(barsReadTarget, complete, barsLevel);
         res.draw(rescaled1, complete, {&vs[6 * (rotate * 2 + mirror)], 6}, dst);
         res.draw(rescaled2, rescaled1, vs2, dst, blur);
         res.draw(rescaled1, rescaled2, vs3, dst, blur);
@@ -125,10 +142,32 @@ struct ScreenCapturer : IVideoCapturer {
         DEFER { readSurface->Unmap(); };
         for (UINT y = 0; y < rescaledDesc.Height; y++)
             memcpy(&collected[y * rescaledDesc.Width], &mapped.pBits[y * mapped.Pitch], rescaledDesc.Width * sizeof(FLOATX4));
+        updateCrop();
         return collected;
     }
 
 private:
+    // Look for black bars in the mip level copied earlier in this update. Mapping
+    // `cpuReadTarget` has already waited for the GPU to finish that copy, so this doesn't
+    // stall. The new crop applies from the next frame on.
+    void updateCrop() {
+        D3D11_TEXTURE2D_DESC completeDesc;
+        D3D11_TEXTURE2D_DESC barsDesc;
+        complete->GetDesc(&completeDesc);
+        barsReadTarget->GetDesc(&barsDesc);
+        auto readSurface = barsReadTarget.reinterpret<IDXGISurface>();
+        DXGI_MAPPED_RECT mapped;
+        winapi::throwOnFalse(readSurface->Map(&mapped, DXGI_MAP_READ));
+        DEFER { readSurface->Unmap(); };
+        bgra_frame small;
+        small.data = mapped.pBits;
+        small.width = barsDesc.Width;
+        small.height = barsDesc.Height;
+        small.pitch = mapped.Pitch;
+        auto r = bars.update(small, completeDesc.Width, completeDesc.Height);
+        crop = {(LONG)r.left, (LONG)r.top, (LONG)r.right, (LONG)r.bottom};
+    }
+
     template <bool dirty>
     util::span<std::conditional_t<dirty, RECT, DXGI_OUTDUPL_MOVE_RECT>> meta() {
         auto data = reinterpret_cast<std::conditional_t<dirty, RECT, DXGI_OUTDUPL_MOVE_RECT>*>(metadata.data());
@@ -148,9 +187,13 @@ private:
     winapi::com_ptr<ID3D11Texture2D> rescaled1;
     winapi::com_ptr<ID3D11Texture2D> rescaled2;
     winapi::com_ptr<ID3D11Texture2D> cpuReadTarget;
+    winapi::com_ptr<ID3D11Texture2D> barsReadTarget;
     winapi::com_ptr<IDXGIOutputDuplication> display;
     std::vector<BYTE> metadata;
     std::vector<FLOATX4> collected;
+    letterbox_detector bars;
+    UINT barsLevel = 0;
+    RECT crop = {};
     bool mirror = false;
     bool rotate = false;
     bool needRelease = false;
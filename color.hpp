@@ -4,7 +4,14 @@
 #include <math.h>
 #include <utility>
 
-struct FLOATX4 {
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define COLOR_SSE2 1
+#endif
+
+// Aligned so that the four components can be loaded into one SIMD register with a single
+// aligned move; the operators below are one packed instruction each where SSE2 is available.
+struct alignas(16) FLOATX4 {
     union { float r, h, x, _1; };
     union { float g, s, y, _2; };
     union { float b, v, z, _3; };
@@ -16,6 +23,60 @@ struct FLOATX4 {
     }
 };
 
+static_assert(sizeof(FLOATX4) == 16, "FLOATX4 must match the layout of R32G32B32A32_FLOAT");
+
+#ifdef COLOR_SSE2
+#define FLOATX4_OP(op, mm)                                                        \
+    static inline FLOATX4 operator op(const FLOATX4& x, const FLOATX4& y) {       \
+        FLOATX4 out;                                                              \
+        _mm_store_ps(&out._1, mm(_mm_load_ps(&x._1), _mm_load_ps(&y._1)));        \
+        return out;                                                               \
+    }                                                                             \
+    static inline FLOATX4 operator op(const FLOATX4& x, float y) {                \
+        FLOATX4 out;                                                              \
+        _mm_store_ps(&out._1, mm(_mm_load_ps(&x._1), _mm_set1_ps(y)));            \
+        return out;                                                               \
+    }
+#else
+#define FLOATX4_OP(op, mm)                                                        \
+    static inline FLOATX4 operator op(const FLOATX4& x, const FLOATX4& y) {       \
+        return x.apply([](float a, float b) { return a op b; }, y);               \
+    }                                                                             \
+    static inline FLOATX4 operator op(const FLOATX4& x, float y) {                \
+        return x.apply([&](float a) { return a op y; });                          \
+    }
+#endif
+FLOATX4_OP(+, _mm_add_ps)
+FLOATX4_OP(-, _mm_sub_ps)
+FLOATX4_OP(*, _mm_mul_ps)
+FLOATX4_OP(/, _mm_div_ps)
+#undef FLOATX4_OP
+
+static inline FLOATX4& operator+=(FLOATX4& x, const FLOATX4& y) { return x = x + y; }
+static inline FLOATX4& operator-=(FLOATX4& x, const FLOATX4& y) { return x = x - y; }
+static inline FLOATX4& operator*=(FLOATX4& x, float y) { return x = x * y; }
+
+// Transpose four colors in place, turning an array of colors into one of channels or back.
+static inline void transpose(FLOATX4 (&m)[4]) {
+#ifdef COLOR_SSE2
+    __m128 x = _mm_load_ps(&m[0]._1), y = _mm_load_ps(&m[1]._1), z = _mm_load_ps(&m[2]._1), w = _mm_load_ps(&m[3]._1);
+    _MM_TRANSPOSE4_PS(x, y, z, w);
+    _mm_store_ps(&m[0]._1, x), _mm_store_ps(&m[1]._1, y), _mm_store_ps(&m[2]._1, z), _mm_store_ps(&m[3]._1, w);
+#else
+    for (size_t i = 0; i < 4; i++)
+        for (size_t j = i + 1; j < 4; j++)
+            std::swap((&m[i]._1)[j], (&m[j]._1)[i]);
+#endif
+}
+
+// A structure-of-arrays view of four colors after `transpose`: each `FLOATX4` holds one
+// channel of all of them, e.g. `r.y` is the red component of the second color. Kernels that
+// mix channels (luma, maxima, ...) can then process four colors per instruction.
+union color_planes {
+    struct { FLOATX4 r, g, b, a; };
+    FLOATX4 c[4];
+};
+
 static FLOATX4 u2qd(uint32_t q) {
     return {(uint8_t)(q >> 16) / 255.f, (uint8_t)(q >> 8) / 255.f, (uint8_t)q / 255.f, (uint8_t)(q >> 24) / 255.f};
 }
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+
+#define CONFIG_NOP(x) x
+#define CONFIG_MAP(f, ...) \
+    CONFIG_NOP(f(uint32_t, width,       16,          __VA_ARGS__)); \
+    CONFIG_NOP(f(uint32_t, height,      9,           __VA_ARGS__)); \
+    CONFIG_NOP(f(uint32_t, musicLeds,   20,          __VA_ARGS__)); \
+    CONFIG_NOP(f(uint32_t, serial,      3,           __VA_ARGS__)); \
+    CONFIG_NOP(f(uint32_t, color,       0x00FFFFFFu, __VA_ARGS__)); \
+    CONFIG_NOP(f(bool,     spiStrips,   0,           __VA_ARGS__)); \
+    CONFIG_NOP(f(uint32_t, spiMusic,    0,           __VA_ARGS__)); \
+    CONFIG_NOP(f(bool,     dithering,   0,           __VA_ARGS__)); \
+    CONFIG_NOP(f(double,   brightnessV, .7,          __VA_ARGS__)); \
+    CONFIG_NOP(f(double,   brightnessA, .4,          __VA_ARGS__)); \
+    CONFIG_NOP(f(double,   gamma,       2.,          __VA_ARGS__)); \
+    CONFIG_NOP(f(double,   temperature, 6600.,       __VA_ARGS__)); \
+    CONFIG_NOP(f(double,   minLevel,    0.,          __VA_ARGS__)); \
+    CONFIG_NOP(f(double,   zoneDepth,   0.,          __VA_ARGS__)); \
+    CONFIG_NOP(f(double,   zoneOverlap, 0.,          __VA_ARGS__)); \
+    CONFIG_NOP(f(double,   smoothing,   .1,          __VA_ARGS__));
+#define CONFIG_DECLARE(T, name, default, wrapper) wrapper<T> name{default}
+#define CONFIG_WRITE(T, name, default, out, s) out << #name << " " << s.name << "\n"
+#define CONFIG_READ(T, name, default, key, in, s) if (T value; key == #name && in >> value) s.name = value
+
+// Everything the user can change, readable and writable from any thread.
+struct settings { CONFIG_MAP(CONFIG_DECLARE, std::atomic) };
+
+// Whether a pair of strips (0 = screen, 1 = music) is APA102-like. `spiMusic` is 0 if the
+// music strips are the same kind as the screen strips, 1 if they're WS281x, 2 if APA102.
+inline bool spiPair(const settings& s, uint8_t pair) {
+    return pair && s.spiMusic ? s.spiMusic == 2 : s.spiStrips.load();
+}
@@ -0,0 +1,110 @@
+#include "capture.h"
+#include "config.hpp"
+#include "pipeline.h"
+
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+
+// A headless version of the app: runs the same pipeline as the UI, but without any
+// windows. Capture sources are synthetic and the serial port discards everything, so
+// this measures (and lets a profiler look at) the cost of the processing itself.
+//
+//     ambilightd [--config PATH] [--seconds N] [--fps N] [--rate N] [--screen WxH [--incremental]]
+//                [--port PATH]
+//
+// With `--screen`, video frames are rendered at the specified resolution and then
+// downscaled on the CPU as if they were grabbed from an actual display. Adding
+// `--incremental` (and setting `zoneDepth` in the config) accumulates zones only
+// from the parts of those frames that change instead. With `--port`, everything is
+// sent to an actual serial device, e.g. an Arduino or the terminal printed by
+// `arduinoemu`, so that the serial fps is what the LEDs would really get.
+// Prints throughput once per second until N seconds pass or SIGINT/SIGTERM is received.
+
+static std::atomic<bool> terminate{false};
+
+struct counting_port : serial_port {
+    counting_port(std::atomic<uint64_t>& counter, std::unique_ptr<serial_port> inner)
+        : counter(counter), inner(std::move(inner)) {}
+
+    void write(util::span<const uint8_t> data) override {
+        if (inner)
+            inner->write(data);
+        counter += data.size();
+    }
+
+    uint8_t read() override { return inner ? inner->read() : '>'; }
+
+private:
+    std::atomic<uint64_t>& counter;
+    std::unique_ptr<serial_port> inner;
+};
+
+int main(int argc, char** argv) {
+    std::string configPath = "ambilight.cfg";
+    std::string portPath;
+    uint32_t seconds = 0;
+    uint32_t fps = 60;
+    uint32_t rate = 48000;
+    uint32_t screenW = 0;
+    uint32_t screenH = 0;
+    bool incremental = false;
+    for (int i = 1; i < argc; i++) {
+        std::string key = argv[i];
+        bool haveValue = i + 1 < argc;
+        if (key == "--incremental")
+            incremental = true;
+        else if (key == "--config" && haveValue)
+            configPath = argv[++i];
+        else if (key == "--seconds" && haveValue)
+            seconds = std::stoul(argv[++i]);
+        else if (key == "--fps" && haveValue)
+            fps = std::stoul(argv[++i]);
+        else if (key == "--port" && haveValue)
+            portPath = argv[++i];
+        else if (key == "--rate" && haveValue)
+            rate = std::stoul(argv[++i]);
+        else if (key == "--screen" && haveValue && sscanf(argv[++i], "%ux%u", &screenW, &screenH) == 2)
+            continue;
+        else {
+            std::cerr << "invalid option: " << key << "\n";
+            return 2;
+        }
+    }
+
+    settings config;
+    std::ifstream in{configPath};
+    for (std::string key; in >> key; ) { CONFIG_MAP(CONFIG_READ, key, in, config) }
+
+    std::signal(SIGINT, [](int) { terminate = true; });
+    std::signal(SIGTERM, [](int) { terminate = true; });
+
+    std::atomic<uint64_t> bytes{0};
+    pipeline::frame_source frames;
+    if (incremental && screenW)
+        frames = [&] { return synthesizeFrames(screenW, screenH, fps); };
+    pipeline lights{config,
+        [&](uint32_t w, uint32_t h) {
+            return screenW ? captureFrames(synthesizeFrames(screenW, screenH, fps), w, h)
+                           : captureSyntheticVideo(w, h, fps); },
+        frames,
+        [&] { return captureSyntheticAudio(rate); },
+        [&](uint32_t) { return std::make_unique<counting_port>(bytes,
+            portPath.empty() ? nullptr : std::make_unique<posix_serial_port>(portPath.c_str())); }};
+    lights.setBothPatterns();
+
+    uint64_t last[4] = {};
+    for (uint32_t t = 0; !terminate && (!seconds || t < seconds); t++) {
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        uint64_t now[4] = {lights.videoFrames, lights.audioFrames, lights.serialFrames, bytes};
+        std::cout << "video " << now[0] - last[0] << " fps, audio " << now[1] - last[1]
+                  << " fps, serial " << now[2] - last[2] << " fps, " << now[3] - last[3] << " B/s\n";
+        std::copy(std::begin(now), std::end(now), std::begin(last));
+    }
+    return 0;
+}
@@ -0,0 +1,205 @@
+#include "downscale.h"
+
+#include <algorithm>
+#include <math.h>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define DOWNSCALE_SSE2 1
+#endif
+
+// Same as in the `blur` pixel shader; see the comment there.
+static const float blurOffset[] = {1.4850044983805901f, 3.4650570548417856f, 5.4452207648927855f, 7.425557483188341f, 9.406126897065857f};
+static const float blurWeight[] = {0.15186256685575583f, 0.12458323113065647f, 0.08723135590047126f, 0.05212966006304008f, 0.026588224962816442f};
+static const float blurW0 = 0.07978845608028654f;
+
+// Average each 2x2 block of BGRA pixels, rounding to nearest like a GPU would. If the source
+// has an odd width or height, the last column or row is dropped (or duplicated if it is the
+// only one).
+static void halve(const uint8_t* src, size_t pitch, uint32_t sw, uint32_t sh, uint8_t* dst, uint32_t dw, uint32_t dh) {
+    for (uint32_t y = 0; y < dh; y++, dst += dw * 4) {
+        const uint8_t* a = src + std::min(2 * y, sh - 1) * pitch;
+        const uint8_t* b = src + std::min(2 * y + 1, sh - 1) * pitch;
+        uint32_t x = 0;
+#ifdef DOWNSCALE_SSE2
+        // 8 source pixels from each row -> 4 output pixels.
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i two = _mm_set1_epi16(2);
+        for (; x + 4 <= dw && sw >= 2; x += 4) {
+            __m128i a0 = _mm_loadu_si128((const __m128i*)(a + x * 8));
+            __m128i a1 = _mm_loadu_si128((const __m128i*)(a + x * 8 + 16));
+            __m128i b0 = _mm_loadu_si128((const __m128i*)(b + x * 8));
+            __m128i b1 = _mm_loadu_si128((const __m128i*)(b + x * 8 + 16));
+            // Vertical sums, two 16-bit pixels per register.
+            __m128i s0 = _mm_add_epi16(_mm_unpacklo_epi8(a0, zero), _mm_unpacklo_epi8(b0, zero));
+            __m128i s1 = _mm_add_epi16(_mm_unpackhi_epi8(a0, zero), _mm_unpackhi_epi8(b0, zero));
+            __m128i s2 = _mm_add_epi16(_mm_unpacklo_epi8(a1, zero), _mm_unpacklo_epi8(b1, zero));
+            __m128i s3 = _mm_add_epi16(_mm_unpackhi_epi8(a1, zero), _mm_unpackhi_epi8(b1, zero));
+            // Horizontal sums of adjacent pixels.
+            __m128i h0 = _mm_add_epi16(_mm_unpacklo_epi64(s0, s1), _mm_unpackhi_epi64(s0, s1));
+            __m128i h1 = _mm_add_epi16(_mm_unpacklo_epi64(s2, s3), _mm_unpackhi_epi64(s2, s3));
+            h0 = _mm_srli_epi16(_mm_add_epi16(h0, two), 2);
+            h1 = _mm_srli_epi16(_mm_add_epi16(h1, two), 2);
+            _mm_storeu_si128((__m128i*)(dst + x * 4), _mm_packus_epi16(h0, h1));
+        }
+#endif
+        for (; x < dw; x++) {
+            size_t i = std::min(2 * x, sw - 1) * 4;
+            size_t j = std::min(2 * x + 1, sw - 1) * 4;
+            for (size_t c = 0; c < 4; c++)
+                dst[x * 4 + c] = (uint8_t)((a[i + c] + a[j + c] + b[i + c] + b[j + c] + 2) >> 2);
+        }
+    }
+}
+
+static FLOATX4 lerp(FLOATX4 a, FLOATX4 b, float t) {
+    return a + (b - a) * t;
+}
+
+static FLOATX4 texel(const uint8_t* data, size_t pitch, uint32_t x, uint32_t y) {
+    const uint8_t* p = data + y * pitch + x * 4;
+    return {p[2] / 255.f, p[1] / 255.f, p[0] / 255.f, p[3] / 255.f};
+}
+
+downscaler::downscaler(uint32_t w, uint32_t h)
+    : w(w), h(h), grid(w * h), line(std::max(w, h)), collected(w * h)
+{
+    // Linearly sampling between texels k and k+1 at offset k+f is the same as weighting
+    // them by 1-f and f respectively.
+    kernel[10] = blurW0;
+    for (size_t i = 0; i < 5; i++) {
+        auto k = (size_t)blurOffset[i];
+        auto f = blurOffset[i] - k;
+        kernel[10 + k] += blurWeight[i] * (1 - f);
+        kernel[10 - k] += blurWeight[i] * (1 - f);
+        kernel[11 + k] += blurWeight[i] * f;
+        kernel[9 - k]  += blurWeight[i] * f;
+    }
+}
+
+void downscaler::buildTaps(std::vector<tap>& out, uint32_t n, bool vertical, uint32_t lod, uint32_t from, uint32_t to) {
+    out.resize(n);
+    auto size = vertical ? levels[0].height : levels[0].width;
+    for (uint32_t i = 0; i < n; i++) {
+        // Output pixels 0 and n-1 sample the centers of the first and last texels; see `QUADP`.
+        float c = from + (n > 1 ? .5f + (float)i * (to - from - 1) / (n - 1) : (to - from) / 2.f);
+        for (uint32_t k = 0; k < 2; k++) {
+            auto& l = levels[std::min<size_t>(lod + k, levels.size() - 1)];
+            auto lsize = vertical ? l.height : l.width;
+            float u = std::max(0.f, c / size * lsize - .5f);
+            auto i0 = std::min((uint32_t)u, lsize - 1);
+            out[i].i[k][0] = i0;
+            out[i].i[k][1] = std::min(i0 + 1, lsize - 1);
+            out[i].f[k] = u - (uint32_t)u;
+        }
+    }
+}
+
+void downscaler::blur(FLOATX4* data, size_t n, size_t stride, size_t count, size_t step) {
+    for (size_t j = 0; j < count; j++, data += step) {
+        for (size_t i = 0; i < n; i++)
+            line[i] = data[i * stride];
+        for (size_t i = 0; i < n; i++) {
+            FLOATX4 sum = {0, 0, 0, 0};
+            for (ptrdiff_t k = -10; k <= 10; k++) {
+                const auto& c = line[std::min<ptrdiff_t>(std::max<ptrdiff_t>((ptrdiff_t)i + k, 0), n - 1)];
+                sum += c * kernel[k + 10];
+            }
+            data[i * stride] = sum;
+        }
+    }
+}
+
+util::span<const FLOATX4> downscaler::operator()(const bgra_frame& frame) {
+    // The grid is in the source image's orientation, rotated into place at the end.
+    uint32_t gw = frame.rotate ? h : w;
+    uint32_t gh = frame.rotate ? w : h;
+    // Enough levels for sampling the uncropped frame, which is at least as many as
+    // are needed for any crop, plus the one the letterbox detector looks at.
+    float lod = std::max(0.f, log2f(std::max((float)frame.width / gw, (float)frame.height / gh)));
+    auto detect = letterboxLevel(frame.width, frame.height);
+    auto needed = std::max((uint32_t)lod + 1, detect);
+
+    size_t count = 1;
+    for (auto w = frame.width, h = frame.height; count <= needed && (w > 1 || h > 1); w /= 2, h /= 2)
+        count++;
+    levels.resize(count); // Level 0 is the frame itself, so its `data` is unused.
+    levels[0].width = frame.width;
+    levels[0].height = frame.height;
+    for (size_t k = 1; k < count; k++) {
+        auto& prev = levels[k - 1];
+        auto& next = levels[k];
+        next.width = std::max(prev.width / 2, 1u);
+        next.height = std::max(prev.height / 2, 1u);
+        next.data.resize(next.width * next.height * 4);
+        halve(k == 1 ? frame.data : prev.data.data(), k == 1 ? frame.pitch : prev.width * 4,
+              prev.width, prev.height, next.data.data(), next.width, next.height);
+    }
+
+    auto& small = levels[std::min<size_t>(detect, count - 1)];
+    auto crop = detect && count > 1
+        ? bars.update({small.data.data(), small.width, small.height, small.width * 4}, frame.width, frame.height)
+        : bars.update(frame, frame.width, frame.height);
+    // Same level of detail the GPU would pick for trilinear filtering.
+    lod = std::max(0.f, log2f(std::max((float)(crop.right - crop.left) / gw, (float)(crop.bottom - crop.top) / gh)));
+    auto lower = (uint32_t)lod;
+    auto t = lod - lower;
+    buildTaps(xTaps, gw, false, lower, crop.left, crop.right);
+    buildTaps(yTaps, gh, true, lower, crop.top, crop.bottom);
+    const uint8_t* data[2];
+    size_t pitch[2];
+    for (uint32_t k = 0; k < 2; k++) {
+        auto i = std::min<size_t>(lower + k, levels.size() - 1);
+        data[k] = i ? levels[i].data.data() : frame.data;
+        pitch[k] = i ? levels[i].width * 4 : frame.pitch;
+    }
+    for (uint32_t y = 0; y < gh; y++) {
+        const auto& ty = yTaps[y];
+        for (uint32_t x = 0; x < gw; x++) {
+            const auto& tx = xTaps[x];
+            FLOATX4 c[2];
+            for (uint32_t k = 0; k < 2; k++) {
+                auto top = lerp(texel(data[k], pitch[k], tx.i[k][0], ty.i[k][0]),
+                                texel(data[k], pitch[k], tx.i[k][1], ty.i[k][0]), tx.f[k]);
+                auto bot = lerp(texel(data[k], pitch[k], tx.i[k][0], ty.i[k][1]),
+                                texel(data[k], pitch[k], tx.i[k][1], ty.i[k][1]), tx.f[k]);
+                c[k] = lerp(top, bot, ty.f[k]);
+            }
+            grid[y * gw + x] = lerp(c[0], c[1], t);
+        }
+    }
+
+    blur(grid.data(), gw, 1, gh, gw);
+    blur(grid.data(), gh, gw, gw, 1);
+
+    for (uint32_t y = 0; y < h; y++) {
+        for (uint32_t x = 0; x < w; x++) {
+            // Rotating clockwise moves the bottom left corner of the source to the top left.
+            uint32_t sx = frame.rotate ? y : x;
+            uint32_t sy = frame.rotate ? gh - 1 - x : y;
+            if (frame.mirror)
+                sx = gw - 1 - sx, sy = gh - 1 - sy;
+            collected[y * w + x] = grid[sy * gw + sx];
+        }
+    }
+    return collected;
+}
+
+struct FrameCapturer : IVideoCapturer {
+    FrameCapturer(std::unique_ptr<IFrameSource> source, uint32_t w, uint32_t h)
+        : source(std::move(source)), process(w, h)
+    {}
+
+    util::span<const FLOATX4> next(uint32_t timeout) override {
+        auto frame = source->next(timeout);
+        return frame ? process(frame) : util::span<const FLOATX4>{};
+    }
+
+private:
+    std::unique_ptr<IFrameSource> source;
+    downscaler process;
+};
+
+std::unique_ptr<IVideoCapturer> captureFrames(std::unique_ptr<IFrameSource> source, uint32_t w, uint32_t h) {
+    return std::make_unique<FrameCapturer>(std::move(source), w, h);
+}
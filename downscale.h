@@ -0,0 +1,47 @@
+#pragma once
+
+#include "capture.h"
+#include "color.hpp"
+#include "letterbox.h"
+#include "dxui/span.hpp"
+
+#include <stdint.h>
+#include <vector>
+
+// Does on the CPU what `ScreenCapturer` does on the GPU: builds a box-filtered mip chain,
+// samples it trilinearly at w * h points spanning the image edge to edge, then applies
+// the separable Gaussian from the `blur` shader in dxui/shaders_px.hlsl along both axes.
+// Black bars found in one of the mip levels are cropped off before sampling.
+struct downscaler {
+    downscaler(uint32_t w, uint32_t h);
+
+    // Return w * h RGBA pixels, valid until the next call.
+    util::span<const FLOATX4> operator()(const bgra_frame& frame);
+
+private:
+    struct tap {
+        uint32_t i[2][2]; // [mip level][left/right or top/bottom texel]
+        float f[2];       // [mip level] weight of the right/bottom texel
+    };
+
+    struct level {
+        std::vector<uint8_t> data;
+        uint32_t width;
+        uint32_t height;
+    };
+
+    void buildTaps(std::vector<tap>& out, uint32_t n, bool vertical, uint32_t lod, uint32_t from, uint32_t to);
+    void blur(FLOATX4* data, size_t n, size_t stride, size_t count, size_t step);
+
+private:
+    uint32_t w;
+    uint32_t h;
+    std::vector<level> levels;
+    std::vector<tap> xTaps;
+    std::vector<tap> yTaps;
+    std::vector<FLOATX4> grid;
+    std::vector<FLOATX4> line;
+    std::vector<FLOATX4> collected;
+    letterbox_detector bars;
+    float kernel[21] = {};
+};
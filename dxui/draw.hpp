@@ -147,6 +147,11 @@ namespace ui {
             copy(target, source, from, {from.left, from.top});
         }
 
+        // Copy an entire mip level of one texture into the top level of another of that size.
+        void copyMipLevel(ID3D11Texture2D* target, ID3D11Texture2D* source, UINT level) {
+            context->CopySubresourceRegion(target, 0, 0, 0, 0, source, level, nullptr);
+        }
+
         // Clear a region of a texture, setting all pixels in it to the specified ARGB color.
         void clear(ID3D11Texture2D* target, RECT, uint32_t color = 0);
 
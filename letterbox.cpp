@@ -0,0 +1,55 @@
+#include "letterbox.h"
+
+#include <algorithm>
+
+// Pixels with no channel above this value (out of 255) are considered black. Video
+// black is 16, and compression artifacts add a bit of noise on top of that.
+#define LETTERBOX_THRESHOLD 24
+
+// How many frames in a row the bars must stay the same before the capture area shrinks
+// to exclude them, and before it grows back when the picture extends into them.
+#define LETTERBOX_LOCK_FRAMES 30
+#define LETTERBOX_RELEASE_FRAMES 3
+
+static bool isBlack(const uint8_t* p, size_t n, size_t step) {
+    for (size_t i = 0; i < n; i++, p += step)
+        if (std::max({p[0], p[1], p[2]}) > LETTERBOX_THRESHOLD)
+            return false;
+    return true;
+}
+
+frame_rect letterbox_detector::update(const bgra_frame& small, uint32_t width, uint32_t height) {
+    if (small.width != w || small.height != h) {
+        w = small.width;
+        h = small.height;
+        active = candidate = {0, 0, w, h};
+        seen = 0;
+    }
+    // Scanning stops at the first row or column that isn't black, so this only costs
+    // as much as the bars themselves. Nothing covers more than a third of the screen.
+    auto row = [&](uint32_t y) { return isBlack(small.data + y * small.pitch, w, 4); };
+    auto col = [&](uint32_t x) { return isBlack(small.data + x * 4, h, small.pitch); };
+    uint32_t top = 0, bottom = 0, left = 0, right = 0;
+    while (top < h / 3 && row(top)) top++;
+    while (bottom < h / 3 && row(h - 1 - bottom)) bottom++;
+    while (left < w / 3 && col(left)) left++;
+    while (right < w / 3 && col(w - 1 - right)) right++;
+    // An entirely black screen says nothing about the bars, so keep the old ones.
+    if (top < h / 3 || bottom < h / 3) {
+        auto y = std::min(top, bottom), x = std::min(left, right);
+        // The first row or column that isn't black is most likely a mix of the bar and
+        // the picture, so drop it too. Losing a sliver of the picture is less noticeable
+        // than dimming the entire edge.
+        if (y) y++;
+        if (x) x++;
+        frame_rect next = {x, y, w - x, h - y};
+        if (next.left == candidate.left && next.top == candidate.top)
+            seen++;
+        else
+            candidate = next, seen = 1;
+        bool grows = candidate.left <= active.left && candidate.top <= active.top;
+        if (seen >= (grows ? LETTERBOX_RELEASE_FRAMES : LETTERBOX_LOCK_FRAMES))
+            active = candidate;
+    }
+    return {active.left * width / w, active.top * height / h, active.right * width / w, active.bottom * height / h};
+}
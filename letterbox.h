@@ -0,0 +1,37 @@
+#pragma once
+
+#include "capture.h"
+
+#include <algorithm>
+#include <stdint.h>
+
+// Resolution of the image that `letterbox_detector` looks at: enough to find bars
+// to within a couple percent of the screen size.
+#define LETTERBOX_RESOLUTION 64
+
+// Find the smallest mip level of a w * h image that still has at least
+// LETTERBOX_RESOLUTION pixels along the shorter side.
+static uint32_t letterboxLevel(uint32_t w, uint32_t h) {
+    uint32_t level = 0;
+    while (std::min(w, h) >> (level + 1) >= LETTERBOX_RESOLUTION)
+        level++;
+    return level;
+}
+
+// Finds black bars around the picture, e.g. when a 21:9 movie or a 4:3 game is shown
+// on a 16:9 display. Bars must be the same on opposite sides and stay put for a while
+// before the picture is considered cropped, so dark scenes and fades to black don't
+// make the captured area jump around.
+struct letterbox_detector {
+    // Given a scaled down copy of a width * height image (e.g. one of its mip levels),
+    // return the part of the image that has the actual picture in it.
+    frame_rect update(const bgra_frame& small, uint32_t width, uint32_t height);
+
+private:
+    uint32_t w = 0;
+    uint32_t h = 0;
+    // In `small` pixels; scaled to the full image on return.
+    frame_rect active = {};
+    frame_rect candidate = {};
+    uint32_t seen = 0;
+};
@@ -12,33 +12,15 @@
 #include "arduino/arduino.h"
 #include "capture.h"
 #include "color.hpp"
+#include "config.hpp"
 #include "defer.hpp"
-#include "serial.hpp"
+#include "pipeline.h"
 
 #include <atomic>
 #include <string>
 #include <fstream>
-#include <condition_variable>
-#include <mutex>
 
 namespace appui {
-    #define CONFIG_NOP(x) x
-    #define CONFIG_MAP(f, ...) \
-        CONFIG_NOP(f(uint32_t, width,       16,          __VA_ARGS__)); \
-        CONFIG_NOP(f(uint32_t, height,      9,           __VA_ARGS__)); \
-        CONFIG_NOP(f(uint32_t, musicLeds,   20,          __VA_ARGS__)); \
-        CONFIG_NOP(f(uint32_t, serial,      3,           __VA_ARGS__)); \
-        CONFIG_NOP(f(uint32_t, color,       0x00FFFFFFu, __VA_ARGS__)); \
-        CONFIG_NOP(f(bool,     spiStrips,   0,           __VA_ARGS__)); \
-        CONFIG_NOP(f(double,   brightnessV, .7,          __VA_ARGS__)); \
-        CONFIG_NOP(f(double,   brightnessA, .4,          __VA_ARGS__)); \
-        CONFIG_NOP(f(double,   gamma,       2.,          __VA_ARGS__)); \
-        CONFIG_NOP(f(double,   temperature, 6600.,       __VA_ARGS__)); \
-        CONFIG_NOP(f(double,   minLevel,    0.,          __VA_ARGS__));
-    #define CONFIG_DECLARE(T, name, default, wrapper) wrapper<T> name{default}
-
-    struct state { CONFIG_MAP(CONFIG_DECLARE, std::atomic) };
-
     template <typename T>
     struct padded : T {
         template <typename... Args>
@@ -155,7 +137,7 @@ namespace appui {
     // | Serial [-] 3 [+]        [apply] |
     // +---------------------------------+
     struct sizing_config : ui::grid {
-        sizing_config(const state& init)
+        sizing_config(const settings& init)
             : ui::grid(1, 4)
         {
             set({&image, &sliderGrid.pad, &helpLabel.pad, &bottomRow.pad});
@@ -164,13 +146,21 @@ namespace appui {
             sliderGrid.setColStretch(2, 1);
             spiGrid.set({&spiCheckbox, &spiLabel.pad});
             spiGrid.setTarget(&spiCheckbox);
-            spiCheckbox.setState(init.spiStrips ? ui::checkbox::checked : ui::checkbox::unchecked);
+            spiCheckbox.setState(spiPair(init, 0) ? ui::checkbox::checked : ui::checkbox::unchecked);
             spiCheckbox.onClick.addForever([&]{
                 bool newState = spiCheckbox.state() != ui::checkbox::checked;
                 spiCheckbox.setState(newState ? ui::checkbox::checked : ui::checkbox::unchecked);
                 return onChange(4, newState); });
+            spiMusicGrid.set({&spiMusicCheckbox, &spiMusicLabel.pad});
+            spiMusicGrid.setTarget(&spiMusicCheckbox);
+            spiMusicCheckbox.setState(spiPair(init, 1) ? ui::checkbox::checked : ui::checkbox::unchecked);
+            spiMusicCheckbox.onClick.addForever([&]{
+                bool newState = spiMusicCheckbox.state() != ui::checkbox::checked;
+                spiMusicCheckbox.setState(newState ? ui::checkbox::checked : ui::checkbox::unchecked);
+                return onChange(5, newState); });
             bottomRow.set(5, 0, &spiGrid);
-            bottomRow.set(6, 0, &done);
+            bottomRow.set(6, 0, &spiMusicGrid);
+            bottomRow.set(7, 0, &done);
             bottomRow.setColStretch(4, 1);
             w.setValue(init.width);
             h.setValue(init.height);
@@ -188,7 +178,7 @@ namespace appui {
         }
 
     public:
-        // 0 = width, 1 = height, 2 = music leds, 3 = serial port, 4 = SPI
+        // 0 = width, 1 = height, 2 = music leds, 3 = serial port, 4 = SPI, 5 = SPI music strips
         util::event<int /* parameter */, uint32_t /* new value */> onChange;
 
     private:
@@ -196,12 +186,15 @@ namespace appui {
         padded_label helpLabel{{40, 0, 40, 0}, {L"Tweak the values until you get the pattern shown above.",
                                                 ui::font::loadPermanently<IDI_FONT_SEGOE_UI>(), 22}};
         padded_label doneLabel{{20, 0, 20, 0}, {L"Done", ui::font::loadPermanently<IDI_FONT_SEGOE_UI>()}};
-        padded_label spiLabel{{10, 0, 30, 0}, {L"APA102 strips", ui::font::loadPermanently<IDI_FONT_SEGOE_UI>()}};
+        padded_label spiLabel{{10, 0, 30, 0}, {L"APA102 screen strips", ui::font::loadPermanently<IDI_FONT_SEGOE_UI>()}};
+        padded_label spiMusicLabel{{10, 0, 30, 0}, {L"APA102 music strips", ui::font::loadPermanently<IDI_FONT_SEGOE_UI>()}};
         padded<ui::grid> sliderGrid{{40, 40, 40, 40}, 5, 4};
-        padded<ui::grid> bottomRow{{40, 40, 40, 40}, 7, 1};
+        padded<ui::grid> bottomRow{{40, 40, 40, 40}, 8, 1};
         ui::button done{doneLabel.pad};
         ui::buttonlike<ui::grid> spiGrid{2, 1};
         ui::checkbox spiCheckbox;
+        ui::buttonlike<ui::grid> spiMusicGrid{2, 1};
+        ui::checkbox spiMusicCheckbox;
         controlled_number w{sliderGrid, 0, L"Screen width",  1, MAX_LEDS * 4 / 5, 1, true};
         controlled_number h{sliderGrid, 1, L"Screen height", 1, MAX_LEDS * 4 / 5, 1, true};
         controlled_number e{sliderGrid, 2, L"Music LEDs",    2, MAX_LEDS, 2, true};
@@ -240,7 +233,7 @@ namespace appui {
     enum setting { Y, T, Lv, La, Lm };
 
     struct tooltip_config : ui::grid {
-        tooltip_config(const state& init)
+        tooltip_config(const settings& init)
             : ui::grid(1, 4)
         {
             set(0, 1, init.color >> 24 ? &colorTab : nullptr);
@@ -341,7 +334,7 @@ namespace appui {
                        const FLOATX4* ml /* m/2 */, const FLOATX4* mr /* m/2 */, F&& transform) {
             // Order in `colors`: clockwise from top left, then music LEDs left to right.
             auto out = colors.data();
-            auto t0 = transform(0), t1 = transform(1), t2 = transform(2), t3 = transform(3);
+            const auto &t0 = transform(0), &t1 = transform(1), &t2 = transform(2), &t3 = transform(3);
             for (size_t x = w_; x--; ) *out++ = t1(rt[x + h_]);
             for (size_t y = h_; y--; ) *out++ = t1(rt[y]);
             for (size_t x = w_; x--; ) *out++ = t0(*bl++);
@@ -464,12 +457,9 @@ namespace appui {
     };
 }
 
-#define CONFIG_WRITE(T, name, default, out, s) out << #name << " " << s.name << "\n"
-#define CONFIG_READ(T, name, default, key, in, s) if (T value; key == #name && in >> value) s.name = value
-
 int ui::main() {
     bool initialized = true;
-    appui::state config;
+    settings config;
     wchar_t configPath[MAX_PATH];
     size_t i = winapi::throwOnFalse(GetModuleFileName(nullptr, configPath, MAX_PATH));
     configPath[--i] = 'g';
@@ -494,60 +484,6 @@ int ui::main() {
     std::atomic<bool> previewing{false};
     std::atomic<bool> terminate{false};
     std::atomic<bool> changedConfig{false};
-    // These more granular mutexes (mutices?) synchronize writes to each pair of strips
-    // separately. If a capture thread is unable to acquire this mutex in a timely
-    // manner, it assumes the main thread has acquired it for the purpose of displaying
-    // a static pattern and will destroy the capture object until the mutex becomes
-    // available again. (`videoMutex` must also be held while writing `averageColor`.)
-    std::timed_mutex videoMutex;
-    std::timed_mutex audioMutex;
-    // Start in the non-capturing state. The locks will be released after everything
-    // is ready, and maybe the initial configuration is done.
-    std::unique_lock<std::timed_mutex> videoLock{videoMutex};
-    std::unique_lock<std::timed_mutex> audioLock{audioMutex};
-    // This mutex synchronizes writes to `frameData` with the serial thread's reads.
-    // A write-release that set `frameDirty` must be preceded by firing off `frameEv`.
-    // NOTE: deadlock-avoiding resource hierarchy: `videoLock`, then `audioLock`, then `mut`.
-    std::mutex mut;
-    std::condition_variable frameEv;
-    FLOATX4 frameData[4][MAX_LEDS] = {};
-    FLOATX4 averageColor = u2qd(config.color);
-    bool frameDirty = false;
-
-    auto updateLocked = [&](auto&& unsafePart) {
-        if (auto lk = std::unique_lock<std::mutex>(mut)) {
-            unsafePart();
-            frameDirty = true;
-            frameEv.notify_all();
-        }
-        if (previewing)
-            mainWindow.post(0);
-    };
-
-    auto loopThread = [&](auto&& f) {
-        return std::thread{[&, f = std::move(f)] {
-            while (!terminate) try {
-                f();
-            } catch (const std::exception&) {
-                // Probably just device reconfiguration or whatever.
-                // TODO only these errors are non-fatal for audio capturing:
-                //     AUDCLNT_E_DEVICE_INVALIDATED
-                //     AUDCLNT_E_DEVICE_IN_USE
-                //     AUDCLNT_E_SERVICE_NOT_RUNNING
-                //     AUDCLNT_E_BUFFER_OPERATION_PENDING
-                // TODO only these errors are non-fatal for video capturing:
-                //     DXGI_ERROR_DRIVER_INTERNAL_ERROR
-                //     DXGI_ERROR_DEVICE_REMOVED
-                //     DXGI_ERROR_DEVICE_RESET
-                //     DXGI_ERROR_ACCESS_LOST
-                //     DXGI_ERROR_UNSUPPORTED
-                //     DXGI_ERROR_SESSION_DISCONNECTED
-                //     E_ACCESSDENIED
-                //     E_OUTOFMEMORY
-                Sleep(500);
-            }
-        }};
-    };
 
     auto configDumpThread = std::thread([&] {
         for (; !terminate; Sleep(1000)) if (changedConfig.exchange(false)) {
@@ -556,146 +492,29 @@ int ui::main() {
         }
     });
 
-    auto videoCaptureThread = loopThread([&] {
-        // Wait until the main thread allows capture threads to proceed.
-        { std::unique_lock<std::timed_mutex> lk(videoMutex); };
-        uint32_t w = config.width;
-        uint32_t h = config.height;
-        auto cap = captureScreen(0, w, h);
-        while (!terminate) if (auto in = cap->next()) {
-            FLOATX4 sum = {0, 0, 0, 0};
-            for (const auto& color : in)
-                sum = sum.apply([](float x, float y) { return x + y; }, color);
-            auto lk = std::unique_lock<std::timed_mutex>(videoMutex, std::chrono::milliseconds(30));
-            if (!lk)
-                return;
-            updateLocked([&] {
-                averageColor = sum.apply([&](float x) { return x / w / h; });
-                auto a = frameData[0], b = frameData[1];
-                for (auto x = w; x--; ) *a++ = in[(h - 1) * w + x]; // bottom right -> bottom left
-                for (auto y = h; y--; ) *a++ = in[y * w];           // bottom left -> top left
-                for (auto y = h; y--; ) *b++ = in[y * w + w - 1];   // bottom right -> top right
-                for (auto x = w; x--; ) *b++ = in[x];               // top right -> top left
-            });
-        }
-    });
-
-    auto audioCaptureThread = loopThread([&] {
-        { std::unique_lock<std::timed_mutex> lk(audioMutex); };
-        auto cap = captureDefaultAudioOutput();
-        while (!terminate) if (auto in = cap->next()) {
-            auto lk = std::unique_lock<std::timed_mutex>(audioMutex, std::chrono::milliseconds(30));
-            if (!lk)
-                return;
-            updateLocked([&, half = in.size() / 2, size = config.musicLeds / 2] {
-                auto ac = rgba2hsva(averageColor);
-                ac.s = std::min(ac.v, .5f) * 2 * ac.s; // Avoid abrupt color changes on fade to black.
-                ac.v = std::max(ac.v, .5f); // Ensure the strip is always visible at all.
-                size_t j = 0;
-                for (auto* out : {frameData[2], frameData[3]}) {
-                    size_t i = 0;
-                    for (size_t k = half; k--;) {
-                        auto c = hsva2rgba({ac.h, ac.s, ac.v * (k + 1) / half, ac.v * (k + 1) / half});
-                        // Yay, hardcoded coefficients! TODO figure out a better mapping.
-                        auto w = (size_t)(tanh(in[j++] / exp((k + 1) * 0.55) / 0.12) * (size - i));
-                        while (w--) out[i++] = c;
-                    }
-                    while (i < size)
-                        out[i++] = {0, 0, 0, 0};
-                }
-            });
-        }
-    });
-
-    auto makeTransform = [&](uint8_t strip) {
-        auto gamma = config.gamma.load();
-        auto white = k2rgba((float)config.temperature.load());
-        auto lower = strip < 2 ? pow(config.minLevel, 1 / gamma) : 0;
-        auto upper = strip < 2 ? config.brightnessV.load() : config.brightnessA.load();
-        return [=](FLOATX4 color) {
-            return color.apply<false>([&](float x, float y) {
-                return 65535 * (float)pow((x * upper * (1 - lower) + lower) * y, gamma); }, white); };
-    };
-
-    mainWindow.onMessage.addForever([&](uintptr_t) {
-        if (previewing)
-            if (auto lk = std::unique_lock<std::mutex>(mut))
-                preview->setColors(frameData[0], frameData[1], frameData[2], frameData[3], makeTransform);
-    });
-
-    auto serialThread = loopThread([&] {
-        auto port = config.serial.load();
-        serial comm{(L"\\\\.\\COM" + std::to_wstring(port)).c_str()};
-        while (port == config.serial && !terminate) {
-            std::unique_lock<std::mutex> lock{mut};
-            // Ping the arduino at least once per ~2s so that it knows the app is still running.
-            if (frameEv.wait_for(lock, std::chrono::seconds(2), [&]{ return frameDirty; })) {
-                frameDirty = false;
-                for (uint8_t strip = 0; strip < 4; strip++)
-                    comm.update(strip, frameData[strip], makeTransform(strip),
-                        config.spiStrips ? &encodeLED<Y5B8G8R8> : &encodeLED<G8R8B8>);
-            }
-            lock.unlock();
-            comm.submit(config.spiStrips);
-        }
-    });
-
     DEFER {
         terminate = true;
-        // Allow the threads to actually read the flag.
-        if (videoLock) videoLock.unlock();
-        if (audioLock) audioLock.unlock();
-        // Also wake the serial thread so it terminates instantly.
-        updateLocked([&] {});
-        videoCaptureThread.join();
-        audioCaptureThread.join();
-        serialThread.join();
         configDumpThread.join();
     };
 
-    auto setTestPattern = [&] {
-        if (!videoLock) videoLock.lock();
-        if (!audioLock) audioLock.lock();
-        updateLocked([&] {
-            for (auto& strip : frameData)
-                std::fill(std::begin(strip), std::end(strip), FLOATX4{0, 0, 0, 1});
-            size_t w = config.width, h = config.height, m = config.musicLeds;
-            // The pattern depicted in screensetup.png.
-            frameData[0][0]         = frameData[1][0]         = {0, 1, 1, 1};
-            frameData[0][w]         = frameData[0][w - 1]     = {1, 1, 0, 1};
-            frameData[1][h]         = frameData[1][h - 1]     = {1, 0, 1, 1};
-            frameData[0][w + h - 1] = frameData[1][w + h - 1] = {1, 1, 1, 1};
-            // TODO maybe render 2 dots on each instead?
-            std::fill(frameData[2], frameData[2] + m / 2, FLOATX4{1, 1, 0, 1});
-            std::fill(frameData[3], frameData[3] + m / 2, FLOATX4{0, 1, 1, 1});
-        });
+    pipeline lights{config, [](uint32_t w, uint32_t h) { return captureScreen(0, w, h); },
+                    nullptr, captureDefaultAudioOutput, openSerialPort};
+    lights.onUpdate = [&] {
+        if (previewing)
+            mainWindow.post(0);
     };
 
-    auto setVideoPattern = [&](FLOATX4 color) {
-        if (color.a) {
-            if (!videoLock) videoLock.lock();
-            updateLocked([&, s = config.width + config.height] {
-                averageColor = color;
-                std::fill(frameData[0], frameData[0] + s, color);
-                std::fill(frameData[1], frameData[1] + s, color);
+    mainWindow.onMessage.addForever([&](uintptr_t) {
+        if (previewing)
+            lights.view([&](const auto& frameData) {
+                preview->setColors(frameData[0], frameData[1], frameData[2], frameData[3],
+                                   [&](uint8_t strip) -> const transfer_lut& { return lights.transform(strip); });
             });
-        } else if (videoLock) {
-            videoLock.unlock();
-        }
-    };
+    });
 
     auto setBothPatterns = [&] {
         mainWindow.setNotificationIcon(ui::loadSmallIcon(ui::fromBundled(IDI_APP)), L"Ambilight");
-        setVideoPattern(u2qd(config.color));
-        if (audioLock) {
-            updateLocked([&] {
-                // There's no guarantee that the audio capturer will have anything on first
-                // iteration (might be nothing playing), so clear the test pattern explicitly.
-                std::fill(std::begin(frameData[2]), std::end(frameData[2]), FLOATX4{0, 0, 0, 1});
-                std::fill(std::begin(frameData[3]), std::end(frameData[3]), FLOATX4{0, 0, 0, 1});
-            });
-            audioLock.unlock();
-        }
+        lights.setBothPatterns();
     };
 
     auto openPreview = [&] {
@@ -730,7 +549,7 @@ int ui::main() {
         sizingWindow->onClose.addForever([&]{ setBothPatterns(); });
         sizingWindow->setShadow(true);
         sizingWindow->show();
-        setTestPattern();
+        lights.setTestPattern();
     };
 
     sizingConfig.onChange.addForever([&](int i, uint32_t value) {
@@ -739,9 +558,15 @@ int ui::main() {
             case 1: config.height = value; break;
             case 2: config.musicLeds = value; break;
             case 3: config.serial = value; break;
-            case 4: config.spiStrips = value; break;
+            case 4:
+                // The music strips' checkbox shouldn't change along with this one.
+                if (!config.spiMusic)
+                    config.spiMusic = spiPair(config, 1) ? 2 : 1;
+                config.spiStrips = value;
+                break;
+            case 5: config.spiMusic = value ? 2 : 1; break;
         }
-        setTestPattern();
+        lights.setTestPattern();
         changedConfig = true;
     });
     tooltipConfig.onChange.addForever([&](appui::setting s, double v) {
@@ -752,11 +577,11 @@ int ui::main() {
             case appui::La: config.brightnessA = v; break;
             case appui::Lm: config.minLevel = v; break;
         }
-        updateLocked([&]{ }); // Ping the serial thread.
+        lights.ping();
         changedConfig = true;
     });
     tooltipConfig.onColor.addForever([&](uint32_t c) {
-        setVideoPattern(u2qd(config.color = c));
+        lights.setVideoPattern(u2qd(config.color = c));
         changedConfig = true;
     });
 
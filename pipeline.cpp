@@ -0,0 +1,286 @@
+#include "pipeline.h"
+#include "smoothing.h"
+#include "zones.h"
+
+#include <algorithm>
+#include <chrono>
+#include <exception>
+
+// When sampling zones instead of border pixels, the number of pixels captured per LED
+// along each axis. Zone edges are rounded to this granularity.
+#define ZONE_SUBDIVISION 4
+
+// While the smoothed LED colors are still catching up with the screen, keep updating
+// them at least this often (in milliseconds) even if the screen isn't changing.
+#define SMOOTH_INTERVAL 33
+
+// While dithering, resend frames no more often than this (in milliseconds), or than the
+// serial link can carry them if that is slower. A port that doesn't wait for the Arduino
+// (e.g. ambilightd's null port) would otherwise keep the serial thread spinning.
+#define DITHER_INTERVAL 2
+
+pipeline::pipeline(settings& config, video_source video, frame_source frames, audio_source audio, port_source port)
+    : config(config)
+{
+    averageColor.write([&](FLOATX4& c) { c = u2qd(config.color); });
+    threads[0] = loopThread([this, video = std::move(video), frames = std::move(frames)] {
+        frames && this->config.zoneDepth > 0 ? frameCaptureThread(frames) : videoCaptureThread(video); });
+    threads[1] = loopThread([this, audio = std::move(audio)] { audioCaptureThread(audio); });
+    threads[2] = loopThread([this, port = std::move(port)] { serialThread(port); });
+}
+
+pipeline::~pipeline() {
+    terminate = true;
+    // Allow the threads to actually read the flag.
+    if (videoLock) videoLock.unlock();
+    if (audioLock) audioLock.unlock();
+    // Also wake the serial thread so it terminates instantly.
+    wake.notify();
+    for (auto& thread : threads)
+        thread.join();
+}
+
+template <typename F>
+std::thread pipeline::loopThread(F&& f) {
+    return std::thread{[this, f = std::move(f)] {
+        while (!terminate) try {
+            f();
+        } catch (const std::exception&) {
+            // Probably just device reconfiguration or whatever.
+            // TODO only these errors are non-fatal for audio capturing:
+            //     AUDCLNT_E_DEVICE_INVALIDATED
+            //     AUDCLNT_E_DEVICE_IN_USE
+            //     AUDCLNT_E_SERVICE_NOT_RUNNING
+            //     AUDCLNT_E_BUFFER_OPERATION_PENDING
+            // TODO only these errors are non-fatal for video capturing:
+            //     DXGI_ERROR_DRIVER_INTERNAL_ERROR
+            //     DXGI_ERROR_DEVICE_REMOVED
+            //     DXGI_ERROR_DEVICE_RESET
+            //     DXGI_ERROR_ACCESS_LOST
+            //     DXGI_ERROR_UNSUPPORTED
+            //     DXGI_ERROR_SESSION_DISCONNECTED
+            //     E_ACCESSDENIED
+            //     E_OUTOFMEMORY
+            std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        }
+    }};
+}
+
+template <typename F>
+void pipeline::videoLoop(uint32_t w, uint32_t h, F&& capture) {
+    led_smoother smooth{2 * (w + h)};
+    std::vector<FLOATX4> leds(2 * (w + h));
+    FLOATX4 average = {0, 0, 0, 0};
+    auto last = std::chrono::steady_clock::now();
+    while (!terminate) {
+        bool fresh = capture(smooth.settled() ? 500 : SMOOTH_INTERVAL, &leds[0], &leds[w + h], average);
+        if (!fresh && smooth.settled())
+            continue;
+        auto now = std::chrono::steady_clock::now();
+        auto out = smooth.update(fresh ? leds.data() : nullptr,
+                                 std::chrono::duration<float>(now - last).count(), (float)config.smoothing);
+        last = now;
+        auto lk = std::unique_lock<std::timed_mutex>(videoMutex, std::chrono::milliseconds(30));
+        if (!lk)
+            return;
+        averageColor.write([&](FLOATX4& c) { c = average; });
+        publish(videoStrips, [&](FLOATX4 (&leds)[2][MAX_LEDS]) {
+            std::copy(&out[0], &out[0] + w + h, leds[0]);
+            std::copy(&out[w + h], &out[0] + 2 * (w + h), leds[1]);
+        });
+        videoFrames += fresh;
+    }
+}
+
+void pipeline::videoCaptureThread(const video_source& source) {
+    // Wait until the main thread allows capture threads to proceed.
+    { std::unique_lock<std::timed_mutex> lk(videoMutex); };
+    uint32_t w, h;
+    screenSize(w, h);
+    // A zero depth means "only the border pixels", which is what happens anyway without zones.
+    std::unique_ptr<zone_sampler> zones;
+    if (config.zoneDepth > 0)
+        zones = std::make_unique<zone_sampler>(w, h, w * ZONE_SUBDIVISION, h * ZONE_SUBDIVISION,
+                                               config.zoneDepth, config.zoneOverlap);
+    auto cap = zones ? source(w * ZONE_SUBDIVISION, h * ZONE_SUBDIVISION) : source(w, h);
+    videoLoop(w, h, [&](uint32_t timeout, FLOATX4* a, FLOATX4* b, FLOATX4& average) {
+        auto in = cap->next(timeout);
+        if (!in)
+            return false;
+        if (zones) {
+            zones->update(in);
+            average = zones->average();
+            zones->sample(a, b);
+            return true;
+        }
+        average = {0, 0, 0, 0};
+        for (const auto& color : in)
+            average += color;
+        average = average / (float)w / (float)h;
+        for (auto x = w; x--; ) *a++ = in[(h - 1) * w + x]; // bottom right -> bottom left
+        for (auto y = h; y--; ) *a++ = in[y * w];           // bottom left -> top left
+        for (auto y = h; y--; ) *b++ = in[y * w + w - 1];   // bottom right -> top right
+        for (auto x = w; x--; ) *b++ = in[x];               // top right -> top left
+        return true;
+    });
+}
+
+void pipeline::frameCaptureThread(const frame_source& source) {
+    { std::unique_lock<std::timed_mutex> lk(videoMutex); };
+    uint32_t w, h;
+    screenSize(w, h);
+    zone_accumulator zones{w, h, config.zoneDepth, config.zoneOverlap};
+    auto cap = source();
+    videoLoop(w, h, [&](uint32_t timeout, FLOATX4* a, FLOATX4* b, FLOATX4& average) {
+        auto frame = cap->next(timeout);
+        if (!frame)
+            return false;
+        zones.update(frame);
+        average = zones.average();
+        zones.sample(a, b);
+        return true;
+    });
+}
+
+void pipeline::audioCaptureThread(const audio_source& source) {
+    { std::unique_lock<std::timed_mutex> lk(audioMutex); };
+    auto cap = source();
+    while (!terminate) {
+        auto in = cap->next();
+        audioOverruns = cap->overruns();
+        audioQueued = cap->queued();
+        if (!in)
+            continue;
+        auto lk = std::unique_lock<std::timed_mutex>(audioMutex, std::chrono::milliseconds(30));
+        if (!lk)
+            return;
+        publish(audioStrips, [&, half = in.size() / 2, size = musicLeds()](FLOATX4 (&leds)[2][MAX_LEDS]) {
+            auto ac = rgba2hsva(averageColor.read());
+            ac.s = std::min(ac.v, .5f) * 2 * ac.s; // Avoid abrupt color changes on fade to black.
+            ac.v = std::max(ac.v, .5f); // Ensure the strip is always visible at all.
+            size_t j = 0;
+            for (auto* out : leds) {
+                size_t i = 0;
+                for (size_t k = half; k--;) {
+                    auto c = hsva2rgba({ac.h, ac.s, ac.v * (k + 1) / half, ac.v * (k + 1) / half});
+                    // Yay, hardcoded coefficients! TODO figure out a better mapping.
+                    auto w = (size_t)(tanh(in[j++] / exp((k + 1) * 0.55) / 0.12) * (size - i));
+                    while (w--) out[i++] = c;
+                }
+                while (i < size)
+                    out[i++] = {0, 0, 0, 0};
+            }
+        });
+        audioFrames++;
+    }
+}
+
+void pipeline::screenSize(uint32_t& w, uint32_t& h) const {
+    // Leave room for at least one LED on the vertical sides, same as the UI sliders.
+    w = std::min<uint32_t>(config.width, MAX_LEDS - 1);
+    h = std::min<uint32_t>(config.height, MAX_LEDS - w);
+}
+
+uint32_t pipeline::musicLeds() const {
+    return std::min<uint32_t>(config.musicLeds / 2, MAX_LEDS);
+}
+
+void pipeline::snapshot(FLOATX4 (&out)[4][MAX_LEDS]) {
+    auto video = videoStrips.read();
+    auto audio = audioStrips.read();
+    std::copy(&video.leds[0][0], &video.leds[0][0] + 2 * MAX_LEDS, &out[0][0]);
+    std::copy(&audio.leds[0][0], &audio.leds[0][0] + 2 * MAX_LEDS, &out[2][0]);
+}
+
+void pipeline::serialThread(const port_source& source) {
+    auto port = config.serial.load();
+    serial comm{source(port)};
+    FLOATX4 frame[4][MAX_LEDS];
+    FLOATX4 levels[4][MAX_LEDS];
+    size_t counts[4] = {};
+    transfer_lut transforms[2];
+    auto lastSubmit = std::chrono::steady_clock::now();
+    while (port == config.serial && !terminate) {
+        // Ping the arduino at least once per ~2s so that it knows the app is still running.
+        // While dithering, keep sending frames as fast as the serial link allows instead;
+        // each is slightly different even if nothing has changed.
+        bool dither = config.dithering;
+        std::chrono::steady_clock::duration timeout = std::chrono::seconds(2);
+        if (dither && comm.dithering()) {
+            auto interval = std::max<std::chrono::steady_clock::duration>(
+                std::chrono::milliseconds(DITHER_INTERVAL), comm.airtime());
+            timeout = std::max(lastSubmit + interval - std::chrono::steady_clock::now(),
+                               std::chrono::steady_clock::duration::zero());
+        }
+        bool fresh = wake.wait_for(timeout);
+        if (fresh) {
+            snapshot(frame);
+            for (uint8_t strip = 0; strip < 4; strip++) {
+                auto& transform = transforms[strip / 2];
+                uint32_t w, h;
+                screenSize(w, h);
+                counts[strip] = strip < 2 ? w + h : musicLeds();
+                transform.update(config, strip);
+                transform.apply(frame[strip], levels[strip], counts[strip]);
+            }
+        }
+        if (fresh || dither)
+            for (uint8_t strip = 0; strip < 4; strip++)
+                comm.update(strip, {levels[strip], counts[strip]}, [](FLOATX4 c) { return c; },
+                            spiPair(config, strip / 2), dither);
+        lastSubmit = std::chrono::steady_clock::now();
+        comm.submit();
+        serialFrames++;
+    }
+}
+
+void pipeline::setTestPattern() {
+    if (!videoLock) videoLock.lock();
+    if (!audioLock) audioLock.lock();
+    uint32_t w, h, m = musicLeds();
+    screenSize(w, h);
+    publish(videoStrips, [&](FLOATX4 (&leds)[2][MAX_LEDS]) {
+        for (auto& strip : leds)
+            std::fill(std::begin(strip), std::end(strip), FLOATX4{0, 0, 0, 1});
+        // The pattern depicted in screensetup.png.
+        leds[0][0]         = leds[1][0]         = {0, 1, 1, 1};
+        leds[0][w]         = leds[0][w - 1]     = {1, 1, 0, 1};
+        leds[1][h]         = leds[1][h - 1]     = {1, 0, 1, 1};
+        leds[0][w + h - 1] = leds[1][w + h - 1] = {1, 1, 1, 1};
+    });
+    publish(audioStrips, [&](FLOATX4 (&leds)[2][MAX_LEDS]) {
+        for (auto& strip : leds)
+            std::fill(std::begin(strip), std::end(strip), FLOATX4{0, 0, 0, 1});
+        // TODO maybe render 2 dots on each instead?
+        std::fill(leds[0], leds[0] + m, FLOATX4{1, 1, 0, 1});
+        std::fill(leds[1], leds[1] + m, FLOATX4{0, 1, 1, 1});
+    });
+}
+
+void pipeline::setVideoPattern(FLOATX4 color) {
+    if (color.a) {
+        if (!videoLock) videoLock.lock();
+        averageColor.write([&](FLOATX4& c) { c = color; });
+        uint32_t w, h;
+        screenSize(w, h);
+        publish(videoStrips, [&, s = w + h](FLOATX4 (&leds)[2][MAX_LEDS]) {
+            std::fill(leds[0], leds[0] + s, color);
+            std::fill(leds[1], leds[1] + s, color);
+        });
+    } else if (videoLock) {
+        videoLock.unlock();
+    }
+}
+
+void pipeline::setBothPatterns() {
+    setVideoPattern(u2qd(config.color));
+    if (audioLock) {
+        publish(audioStrips, [&](FLOATX4 (&leds)[2][MAX_LEDS]) {
+            // There's no guarantee that the audio capturer will have anything on first
+            // iteration (might be nothing playing), so clear the test pattern explicitly.
+            for (auto& strip : leds)
+                std::fill(std::begin(strip), std::end(strip), FLOATX4{0, 0, 0, 1});
+        });
+        audioLock.unlock();
+    }
+}
@@ -0,0 +1,139 @@
+#pragma once
+
+#include "arduino/arduino.h"
+#include "capture.h"
+#include "color.hpp"
+#include "config.hpp"
+#include "seqlock.hpp"
+#include "serial.hpp"
+#include "transfer.h"
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+// The most LEDs each strip can have. Only as many as are configured, and as the Arduino
+// can hold, are sent to it.
+static constexpr uint32_t MAX_LEDS = 300;
+
+// Moves data from the capturers to the serial port: a video capture thread that fills
+// strips 0 and 1 with the screen's borders, an audio capture thread that fills strips 2
+// and 3 with a spectrum visualization, and a serial thread that sends everything to
+// the Arduino. Has no UI of its own; all methods must be called from a single thread.
+struct pipeline {
+    using video_source = std::function<std::unique_ptr<IVideoCapturer>(uint32_t w, uint32_t h)>;
+    using frame_source = std::function<std::unique_ptr<IFrameSource>()>;
+    using audio_source = std::function<std::unique_ptr<IAudioCapturer>()>;
+    using port_source  = std::function<std::unique_ptr<serial_port>(uint32_t index)>;
+
+    // Start in the non-capturing state; call `setBothPatterns` or `setTestPattern` next.
+    // If `frames` is set and zones are enabled, LED colors are accumulated incrementally
+    // from the full-resolution frames it provides instead of captured through `video`.
+    pipeline(settings& config, video_source video, frame_source frames, audio_source audio, port_source port);
+    ~pipeline();
+
+    // Pause capturing and display the pattern depicted in screensetup.png.
+    void setTestPattern();
+
+    // Display a static color on the video strips, or resume capturing the screen
+    // if the color is fully transparent.
+    void setVideoPattern(FLOATX4 color);
+
+    // Resume capturing audio, and either video or a static color depending on config.
+    void setBothPatterns();
+
+    // Wake the serial thread, e.g. because the transform has changed.
+    void ping() { notify(); }
+
+    // Call `f(const FLOATX4 (&)[4][MAX_LEDS])` with a snapshot of the current frame.
+    template <typename F>
+    void view(F&& f) {
+        snapshot(viewData);
+        const auto& frame = viewData;
+        f(frame);
+    }
+
+    // Return the function that maps a color from the specified strip to 16-bit LED levels
+    // according to the current settings. Only for use by whoever calls `view`.
+    const transfer_lut& transform(uint8_t strip) {
+        viewTransforms[strip / 2].update(config, strip);
+        return viewTransforms[strip / 2];
+    }
+
+public:
+    // Fired from any thread after the frame changes.
+    std::function<void()> onUpdate;
+
+    // Counters for measuring throughput.
+    std::atomic<uint64_t> videoFrames{0};
+    std::atomic<uint64_t> audioFrames{0};
+    std::atomic<uint64_t> serialFrames{0};
+    // See `IAudioCapturer::overruns` and `IAudioCapturer::queued`.
+    std::atomic<uint64_t> audioOverruns{0};
+    std::atomic<uint64_t> audioQueued{0};
+
+private:
+    // Two strips' worth of colors, written by one thread at a time.
+    struct strip_pair {
+        FLOATX4 leds[2][MAX_LEDS];
+    };
+
+    template <typename F>
+    void publish(seqlock<strip_pair>& pair, F&& f /* = void(FLOATX4 (&)[2][MAX_LEDS]) */) {
+        pair.write([&](strip_pair& p) { f(p.leds); });
+        notify();
+    }
+
+    void notify() {
+        wake.notify();
+        if (onUpdate)
+            onUpdate();
+    }
+
+    void snapshot(FLOATX4 (&out)[4][MAX_LEDS]);
+
+    // The configured strip lengths, limited to what the strip buffers can hold. The UI
+    // never allows more, but the config file may have been edited by hand.
+    void screenSize(uint32_t& w, uint32_t& h) const;
+    uint32_t musicLeds() const;
+
+    template <typename F>
+    std::thread loopThread(F&& f);
+
+    // Repeatedly call `capture(timeout, stripA, stripB, average)`, which returns whether
+    // there was a new frame, and smooth the result over time into strips 0 and 1.
+    template <typename F>
+    void videoLoop(uint32_t w, uint32_t h, F&& capture);
+
+    void videoCaptureThread(const video_source& source);
+    void frameCaptureThread(const frame_source& source);
+    void audioCaptureThread(const audio_source& source);
+    void serialThread(const port_source& source);
+
+private:
+    settings& config;
+    std::atomic<bool> terminate{false};
+    // These mutexes decide who writes each pair of strips. If a capture thread is unable
+    // to acquire its mutex in a timely manner, it assumes the main thread has acquired
+    // it for the purpose of displaying a static pattern and will destroy the capture
+    // object until the mutex becomes available again. (`videoMutex` must also be held
+    // while writing `averageColor`.) The data itself is published without locks, so
+    // neither capturing nor the serial port can ever hold up the other.
+    std::timed_mutex videoMutex;
+    std::timed_mutex audioMutex;
+    // Start in the non-capturing state. The locks will be released after everything
+    // is ready, and maybe the initial configuration is done.
+    std::unique_lock<std::timed_mutex> videoLock{videoMutex};
+    std::unique_lock<std::timed_mutex> audioLock{audioMutex};
+    // NOTE: deadlock-avoiding resource hierarchy: `videoLock`, then `audioLock`.
+    seqlock<strip_pair> videoStrips;
+    seqlock<strip_pair> audioStrips;
+    seqlock<FLOATX4> averageColor;
+    // Fired after any of the above changes.
+    wake_signal wake;
+    // Only touched by whoever calls `view`.
+    FLOATX4 viewData[4][MAX_LEDS] = {};
+    transfer_lut viewTransforms[2];
+    std::thread threads[3];
+};
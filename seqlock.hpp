@@ -0,0 +1,83 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <stdint.h>
+#include <type_traits>
+
+// A value with one writer and any number of readers, none of which ever block each
+// other. The writer bumps a sequence number to an odd value before changing anything
+// and back to an even one after; a reader that sees the number change while it was
+// copying the value simply tries again. Since writes only take a few microseconds,
+// readers hardly ever spin, and a slow reader never delays the writer.
+//
+// NOTE: the writer must be unique at any given time. If it changes hands, some other
+//       synchronization (e.g. a mutex) must order the handover.
+template <typename T>
+struct seqlock {
+    static_assert(std::is_trivially_copyable<T>::value, "readers copy the value bytewise");
+
+    // Call `f(T&)` to modify the value in place.
+    template <typename F>
+    void write(F&& f) {
+        auto s = seq.load(std::memory_order_relaxed);
+        seq.store(s + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        f(value);
+        seq.store(s + 2, std::memory_order_release);
+    }
+
+    // Copy a consistent snapshot of the value.
+    void read(T& out) const {
+        for (;;) {
+            auto s = seq.load(std::memory_order_acquire);
+            if (s & 1)
+                continue;
+            out = value;
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (seq.load(std::memory_order_relaxed) == s)
+                return;
+        }
+    }
+
+    T read() const {
+        T out;
+        read(out);
+        return out;
+    }
+
+private:
+    T value = {};
+    std::atomic<uint32_t> seq{0};
+};
+
+// Wakes up a consumer thread when there's something new for it. Producers never wait
+// for the consumer to finish whatever it is doing: the mutex is only held while the
+// consumer is going to sleep or waking up.
+struct wake_signal {
+    void notify() {
+        pending = true;
+        // Don't let the notification slip in between the consumer checking `pending`
+        // and actually going to sleep.
+        { std::lock_guard<std::mutex> lk(mut); }
+        cv.notify_one();
+    }
+
+    // Block until `notify` is called or the timeout expires; return whether it was called.
+    // Either way, the signal is reset.
+    template <typename Rep, typename Period>
+    bool wait_for(std::chrono::duration<Rep, Period> timeout) {
+        std::unique_lock<std::mutex> lk(mut);
+        if (!cv.wait_for(lk, timeout, [&] { return pending.load(); }))
+            return false;
+        pending = false;
+        return true;
+    }
+
+private:
+    std::atomic<bool> pending{false};
+    std::mutex mut;
+    std::condition_variable cv;
+};
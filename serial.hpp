@@ -3,22 +3,87 @@
 #include "arduino/arduino.h"
 #include "color.hpp"
 #include "dxui/span.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <memory>
+#include <string.h>
+#include <vector>
+
+#ifdef _WIN32
 #include "dxui/winapi.hpp"
+#include <string>
+#else
+#include <string>
+#include <system_error>
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define SERIAL_SSE2 1
+#endif
 
 namespace {
+    // For each 13-bit value of the brightest channel (see `Y5B8G8R8`), the 5-bit global
+    // brightness that makes the LED's output closest to the intended one. A lot of pairs
+    // in 1..31 are coprime, so the smallest possible brightness is not always the best:
+    // a larger one may represent the brightest channel exactly, at the cost of making
+    // the others coarser, which is worth it if the brightest channel's error shrinks by
+    // more than the others' expected rounding error (a quarter of a step each) grows.
+    // Searching that per LED per frame would be too slow, so the answers are precomputed.
+    struct apa102_table {
+        uint8_t brightness[8192];
+        // ceil(2^20 / 2z), for dividing by z with rounding.
+        uint32_t reciprocal[32];
+
+        apa102_table() {
+            reciprocal[0] = 0;
+            for (uint32_t z = 1; z < 32; z++)
+                reciprocal[z] = ((1u << 20) + 2 * z - 1) / (2 * z);
+            for (uint32_t m = 0; m < 8192; m++) {
+                // In units of half a 13-bit step.
+                uint32_t best = 0, bestError = 0;
+                for (uint32_t z = std::max(1u, std::min(31u, (m + 254) / 255)); z < 32; z++) {
+                    auto out = z * std::min(divide(m, z), 255u);
+                    auto error = 2 * (out > m ? out - m : m - out) + z;
+                    if (!best || error < bestError)
+                        best = z, bestError = error;
+                }
+                brightness[m] = (uint8_t)best;
+            }
+        }
+
+        // round(x / z), exactly, for any 13-bit `x`.
+        uint32_t divide(uint32_t x, uint32_t z) const {
+            return (uint32_t)((uint64_t)(2 * x + z) * reciprocal[z] >> 20);
+        }
+    };
+
+    static const apa102_table& apa102() {
+        static const apa102_table table;
+        return table;
+    }
+
     struct Y5B8G8R8 /* APA102-like */ {
         uint8_t Z, B, G, R;
 
         Y5B8G8R8() : Z(0xE0), B(0), G(0), R(0) {}
         Y5B8G8R8(uint16_t r, uint16_t g, uint16_t b, uint16_t /*y*/) {
             // APA102 has a ~13 bit dynamic range thanks to its 5-bit global brightness field.
+            // Non-monotonic colors are very visible, though, and the precise meaning of the
+            // brightness is unclear, so it's assumed to be linear.
             auto m31d32 = [](uint16_t x) { return (x / 256 * 248) + (x % 256 * 31 / 32); };
             r = m31d32(r) / 8, g = m31d32(g) / 8, b = m31d32(b) / 8;
-            // TODO a lot of pairs in 1..31 are coprime, so picking the smallest possible
-            //      global brightness is not always best. Non-monotonic colors are very visible,
-            //      though, and the precise meaning of the brightness is unclear, so...
-            Z = std::max(r, std::max(g, b)) / 256 + 1;
-            R = r / Z, G = g / Z, B = b / Z, Z |= 0xE0;
+            const auto& t = apa102();
+            uint32_t z = t.brightness[std::max(r, std::max(g, b))];
+            R = (uint8_t)std::min(t.divide(r, z), 255u);
+            G = (uint8_t)std::min(t.divide(g, z), 255u);
+            B = (uint8_t)std::min(t.divide(b, z), 255u);
+            Z = (uint8_t)(z | 0xE0);
         }
     };
 
@@ -37,20 +102,92 @@ namespace {
     };
 }
 
-using led_encoder = size_t(size_t, FLOATX4, void*);
+// Call `f(index, const uint16_t (&)[4])` with each color of `in`, passed through `transform`,
+// converted to 16-bit levels (clamped, with luma in place of alpha) 4 LEDs at a time.
+template <typename F /* = FLOATX4(FLOATX4) */, typename G>
+static void forEachLevel(util::span<const FLOATX4> in, F&& transform, G&& f) {
+    for (size_t i = 0; i < in.size(); i += 4) {
+        size_t k = std::min(in.size() - i, (size_t)4);
+        color_planes p = {};
+        for (size_t j = 0; j < k; j++)
+            p.c[j] = transform(in[i + j]);
+        // The fourth level is luma, computed for all four colors at once.
+        transpose(p.c);
+        p.a = p.r * 0.299f + p.g * 0.587f + p.b * 0.114f;
+        transpose(p.c);
+        const auto& c = p.c;
+        alignas(16) uint16_t levels[4][4];
+#ifdef SERIAL_SSE2
+        // There's no unsigned 32 -> 16 bit saturating pack in SSE2, so shift to signed and back.
+        const __m128i bias32 = _mm_set1_epi32(0x8000);
+        const __m128i bias16 = _mm_set1_epi16(-0x8000);
+        for (size_t j = 0; j < 4; j += 2) {
+            __m128i a = _mm_sub_epi32(_mm_cvttps_epi32(_mm_load_ps(&c[j].r)), bias32);
+            __m128i b = _mm_sub_epi32(_mm_cvttps_epi32(_mm_load_ps(&c[j + 1].r)), bias32);
+            _mm_store_si128((__m128i*)levels[j], _mm_xor_si128(_mm_packs_epi32(a, b), bias16));
+        }
+#else
+        for (size_t j = 0; j < 4; j++)
+            for (size_t ch = 0; ch < 4; ch++)
+                levels[j][ch] = (uint16_t)std::min(std::max((&c[j].r)[ch], 0.f), 65535.f);
+#endif
+        for (size_t j = 0; j < k; j++)
+            f(i + j, levels[j]);
+    }
+}
 
-template <typename LED>
-static size_t encodeLED(size_t index, FLOATX4 c, void* out) {
+// Encode `in`, passed through `transform`, into `out` as an array of `LED`s.
+template <typename LED, typename F /* = FLOATX4(FLOATX4) */>
+static void encodeLEDs(util::span<const FLOATX4> in, F&& transform, uint8_t* out) {
     static_assert(AMBILIGHT_SERIAL_CHUNK % sizeof(LED) == 0, "a chunk does not fit a whole number of LEDs");
-    auto old = ((LED*)out)[index];
-    ((LED*)out)[index] = {
-        (uint16_t)c.r, (uint16_t)c.g, (uint16_t)c.b,
-        (uint16_t)(0.299f * c.r + 0.587f * c.g + 0.114f * c.b)};
-    return memcmp(&old, (LED*)out + index, sizeof(LED)) ? index * sizeof(LED) / AMBILIGHT_SERIAL_CHUNK + 1 : 0;
+    auto* leds = (LED*)out;
+    forEachLevel(in, transform, [&](size_t i, const uint16_t (&c)[4]) {
+        leds[i] = {c[0], c[1], c[2], c[3]};
+    });
 }
 
-struct serial {
-    serial(LPCWSTR path) {
+// Same as `encodeLEDs<G8R8B8>`, but each channel of each LED is rounded with the error left
+// over from the last call (3 per LED in `error`, in 16-bit units) added to it, so that over
+// several frames the 8-bit output averages out to the 16-bit level. Return whether any level
+// is between two 8-bit values, i.e. whether the output needs to keep changing to get there.
+template <typename F /* = FLOATX4(FLOATX4) */>
+static bool ditherLEDs(util::span<const FLOATX4> in, F&& transform, uint8_t* out, int16_t* error) {
+    auto* leds = (G8R8B8*)out;
+    bool any = false;
+    forEachLevel(in, transform, [&](size_t i, const uint16_t (&c)[4]) {
+        uint8_t q[3];
+        for (size_t ch = 0; ch < 3; ch++) {
+            // 8-bit `q` is 16-bit `q * 257`, so the error is at most half of that.
+            int32_t v = c[ch] + error[i * 3 + ch];
+            q[ch] = (uint8_t)std::min(std::max((v + 128) / 257, 0), 255);
+            error[i * 3 + ch] = (int16_t)std::min(std::max(v - q[ch] * 257, -128), 128);
+            any |= c[ch] % 257 != 0;
+        }
+        leds[i].R = q[0], leds[i].G = q[1], leds[i].B = q[2];
+    });
+    return any;
+}
+
+// A bidirectional byte stream to the Arduino. Both methods block, and throw if
+// the device does not respond in a reasonable time.
+struct serial_port {
+    virtual ~serial_port() = default;
+    virtual void write(util::span<const uint8_t> data) = 0;
+    virtual uint8_t read() = 0;
+};
+
+// A port that discards everything and pretends that the other side always has
+// a valid frame. Useful for measuring the cost of everything but the transport.
+struct null_serial_port : serial_port {
+    void write(util::span<const uint8_t> data) override { written += data.size(); }
+    uint8_t read() override { return '>'; }
+
+    size_t written = 0;
+};
+
+#ifdef _WIN32
+struct win32_serial_port : serial_port {
+    win32_serial_port(LPCWSTR path) {
         handle.reset(CreateFile(path, GENERIC_READ | GENERIC_WRITE, 0, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0));
         winapi::throwOnFalse(handle);
         DCB serialParams = {};
@@ -76,38 +213,447 @@ struct serial {
         winapi::throwOnFalse(PurgeComm(handle.get(), PURGE_RXCLEAR | PURGE_TXCLEAR));
     }
 
+    void write(util::span<const uint8_t> data) override {
+        DWORD result = (DWORD)data.size();
+        winapi::throwOnFalse(WriteFile(handle.get(), &data[0], result, &result, nullptr) && result == data.size());
+    }
+
+    uint8_t read() override {
+        BYTE response;
+        DWORD result;
+        winapi::throwOnFalse(ReadFile(handle.get(), &response, 1, &result, nullptr) && result == 1);
+        return response;
+    }
+
+private:
+    winapi::handle handle;
+};
+
+// Open `COM<index>`.
+static std::unique_ptr<serial_port> openSerialPort(uint32_t index) {
+    return std::make_unique<win32_serial_port>((L"\\\\.\\COM" + std::to_wstring(index)).c_str());
+}
+#else
+struct posix_serial_port : serial_port {
+    posix_serial_port(const char* path) {
+        fd = open(path, O_RDWR | O_NOCTTY);
+        if (fd < 0)
+            throw std::system_error(errno, std::generic_category(), path);
+        termios tty = {};
+        cfmakeraw(&tty);
+        tty.c_cflag |= CLOCAL | CREAD;
+        // Same as the `ReadIntervalTimeout` on Windows: give up if nothing arrives
+        // for a second. (VTIME is in tenths of a second.)
+        tty.c_cc[VMIN] = 0;
+        tty.c_cc[VTIME] = 10;
+        if (cfsetspeed(&tty, speed()) || tcsetattr(fd, TCSANOW, &tty) || tcflush(fd, TCIOFLUSH)) {
+            close(fd);
+            throw std::system_error(errno, std::generic_category(), path);
+        }
+    }
+
+    ~posix_serial_port() {
+        close(fd);
+    }
+
+    void write(util::span<const uint8_t> data) override {
+        for (size_t i = 0; i < data.size(); ) {
+            auto r = ::write(fd, &data[i], data.size() - i);
+            if (r < 0 && errno != EINTR)
+                throw std::system_error(errno, std::generic_category(), "write");
+            i += r < 0 ? 0 : r;
+        }
+    }
+
+    uint8_t read() override {
+        uint8_t response;
+        ssize_t r;
+        while ((r = ::read(fd, &response, 1)) < 0 && errno == EINTR) {}
+        if (r != 1)
+            throw std::system_error(r ? errno : ETIMEDOUT, std::generic_category(), "read");
+        return response;
+    }
+
+private:
+    static speed_t speed() {
+        switch (AMBILIGHT_SERIAL_BAUD_RATE) {
+            case 115200:  return B115200;
+            case 230400:  return B230400;
+#ifdef B1000000
+            case 500000:  return B500000;
+            case 1000000: return B1000000;
+            case 2000000: return B2000000;
+#endif
+        }
+        throw std::system_error(EINVAL, std::generic_category(), "unsupported baud rate");
+    }
+
+    int fd;
+};
+
+// Open `/dev/ttyACM<index>`, which is where the Arduino Nano Every shows up on Linux.
+static std::unique_ptr<serial_port> openSerialPort(uint32_t index) {
+    return std::make_unique<posix_serial_port>(("/dev/ttyACM" + std::to_string(index)).c_str());
+}
+#endif
+
+// Sends LED data to the Arduino, as little as possible of it. The amount of data each
+// strip can hold on the Arduino's side, and the size of the chunks it is sent in, are
+// learned when connecting; anything beyond that is silently dropped.
+struct serial {
+    serial(std::unique_ptr<serial_port> port)
+        : port(std::move(port))
+    {
+        resize();
+    }
+
+    // Encode the strip's new colors for APA102-like LEDs if `spi` is set, or WS2812-like
+    // ones otherwise. Any LEDs that were there last time but are not now are turned off.
+    // Both strips of a pair (0+1, 2+3) should be the same kind. If `dither` is set, the
+    // 8-bit WS2812-like LEDs are temporally dithered; see `dithering`.
     template <typename F /* = FLOATX4(FLOATX4) */>
-    void update(uint8_t strip, util::span<const FLOATX4> data, F&& transform, led_encoder* encode) {
-        for (size_t i = 0; i < data.size(); i++)
-            if (auto j = encode(i, transform(data[i]), color[strip][0]))
-                valid[strip][j - 1] = false;
+    void update(uint8_t strip, util::span<const FLOATX4> data, F&& transform, bool spi, bool dither = false) {
+        if (spi != spiStrip[strip]) {
+            // Different LED sizes, so nothing is where it used to be.
+            std::fill(color[strip].begin(), color[strip].end(), 0);
+            std::fill(valid[strip].begin(), valid[strip].end(), false);
+            spiStrip[strip] = spi;
+        }
+        unsettled[strip] = false;
+        if (spi) {
+            encode<Y5B8G8R8>(strip, data.size(), [&](uint8_t* out) { encodeLEDs<Y5B8G8R8>(data, transform, out); });
+        } else if (dither) {
+            auto& e = error[strip];
+            if (e.size() < data.size() * 3)
+                e.resize(data.size() * 3, 0);
+            encode<G8R8B8>(strip, data.size(), [&](uint8_t* out) {
+                unsettled[strip] = ditherLEDs(data, transform, out, e.data()); });
+        } else {
+            encode<G8R8B8>(strip, data.size(), [&](uint8_t* out) { encodeLEDs<G8R8B8>(data, transform, out); });
+        }
+    }
+
+    // Whether the last `update` of any strip was dithered and had colors that 8 bits can't
+    // represent, so updating it with the same colors and submitting again would make the
+    // average color more accurate. To be invisible, this should then be done as often as the
+    // serial port allows.
+    bool dithering() const {
+        return unsettled[0] || unsettled[1] || unsettled[2] || unsettled[3];
+    }
+
+    // How long the bytes of the last `submit` take on the wire at 10 bits per byte (start,
+    // 8 data, stop). Submitting again any sooner only queues them up in the port's buffers.
+    std::chrono::microseconds airtime() const {
+        return std::chrono::microseconds(submitted * 10 * 1000000ull / AMBILIGHT_SERIAL_BAUD_RATE);
     }
 
-    void submit(bool spi) {
+    void submit() {
+        submitted = 0;
+        if (!negotiated)
+            negotiate();
+        if (streaming)
+            return stream();
         bool force = !write({'<', 'R', 'G', 'B', 'D', 'A', 'T', 'A'});
         for (size_t strip = 0; strip < 4; strip++) {
-            for (size_t chunk = 0; chunk < AMBILIGHT_CHUNKS_PER_STRIP; chunk++) if (force || !valid[strip][chunk]) {
+            for (size_t chunk = 0; chunk < chunks; chunk++) if (force || !valid[strip][chunk]) {
                 uint8_t tmpb[AMBILIGHT_SERIAL_CHUNK + 1];
                 tmpb[0] = (uint8_t)(strip + chunk * 4);
-                memcpy(tmpb + 1, color[strip][chunk], sizeof(tmpb) - 1);
+                memcpy(tmpb + 1, &color[strip][chunk * chunkSize], sizeof(tmpb) - 1);
                 write(tmpb);
                 valid[strip][chunk] = true;
             }
         }
-        write({(uint8_t)(spi ? 254 : 255)});
+        write({end()});
     }
 
 private:
+    // Call `f(uint8_t*)` to encode `count` LEDs, then mark the chunks that have changed.
+    template <typename LED, typename F>
+    void encode(uint8_t strip, size_t count, F&& f) {
+        auto& out = color[strip];
+        auto n = std::max(count, leds[strip]);
+        if (out.size() < n * sizeof(LED)) {
+            out.resize(n * sizeof(LED));
+            valid[strip].resize((out.size() + chunkSize - 1) / chunkSize, false);
+        }
+        scratch.resize(n * sizeof(LED));
+        f(scratch.data());
+        std::fill((LED*)scratch.data() + count, (LED*)scratch.data() + n, LED{0, 0, 0, 0});
+        // One wide comparison per chunk is much cheaper than one per LED.
+        for (size_t i = 0, j = 0; i < scratch.size(); i += chunkSize, j++) {
+            auto size = std::min(chunkSize, scratch.size() - i);
+            if (memcmp(&out[i], &scratch[i], size)) {
+                memcpy(&out[i], &scratch[i], size);
+                valid[strip][j] = false;
+            }
+        }
+        leds[strip] = count;
+    }
+
+    // All writes go through here so that `airtime` knows how much was sent.
+    void put(util::span<const uint8_t> data) {
+        port->write(data);
+        submitted += data.size();
+    }
+
     bool write(util::span<const uint8_t> data) {
-        BYTE response;
-        DWORD result = (DWORD)data.size();
-        winapi::throwOnFalse(WriteFile(handle.get(), &data[0], result, &result, nullptr) && result == data.size());
-        winapi::throwOnFalse(ReadFile(handle.get(), &response, 1, &result, nullptr) && result == 1);
-        return response == '>';
+        put(data);
+        return port->read() == '>';
+    }
+
+    // The request 249 argument: which pairs of strips are SPI strips.
+    uint8_t kinds() const {
+        return (uint8_t)(spiStrip[0] | spiStrip[2] << 1);
+    }
+
+    // The request that refreshes the LEDs. If the Arduino can't refresh each pair
+    // differently, all strips are assumed to be the same kind as strips 0 and 1.
+    uint8_t end() const {
+        return perPair ? 248 : spiStrip[0] ? 254 : 255;
+    }
+
+    // Ask whether the Arduino understands request 253; older firmware will ignore it
+    // and time out, after which it goes back to waiting for "<RGBDATA". Then ask for
+    // 16-bit chunk indices and set the kind of each pair of strips, which firmware that
+    // doesn't support them rejects the same way.
+    void negotiate() {
+        negotiated = true;
+        write({'<', 'R', 'G', 'B', 'D', 'A', 'T', 'A'});
+        try {
+            write({253});
+        } catch (const std::exception&) {
+            return;
+        }
+        streaming = true;
+        try {
+            put({250, AMBILIGHT_SERIAL_CHUNK});
+            auto size = port->read();
+            auto lo = port->read();
+            auto hi = port->read();
+            port->read();
+            // The Arduino should only pick sizes that AMBILIGHT_SERIAL_CHUNK could be, but
+            // if this is garbage, 8-bit indices still work.
+            if (!size || size >= 63 || size % 12)
+                return;
+            chunkSize = size;
+            chunks = (size_t)(lo | hi << 8) / size;
+            extended = true;
+            resize();
+        } catch (const std::exception&) {
+            return;
+        }
+        try {
+            write({249, kinds()});
+            perPair = true;
+            sentKinds = kinds();
+        } catch (const std::exception&) {
+            return;
+        }
+        // Finish the transaction without showing anything.
+        write({255});
+    }
+
+    // Size the buffers for the current chunk size and count, keeping the colors.
+    void resize() {
+        for (size_t strip = 0; strip < 4; strip++) {
+            color[strip].resize(std::max(color[strip].size(), chunks * chunkSize));
+            shown[strip].assign(chunks * chunkSize, 0);
+            valid[strip].assign((color[strip].size() + chunkSize - 1) / chunkSize, false);
+        }
+        patches.resize(chunks * (chunkSize + 4));
+        frame.resize(4 * chunks * (chunkSize + 4) + 4);
+    }
+
+    // Writes must be split into chunk-sized pieces; see AMBILIGHT_SERIAL_CHUNK.
+    void send(util::span<const uint8_t> data) {
+        for (size_t i = 0; i < data.size(); i += AMBILIGHT_SERIAL_CHUNK + 1)
+            put({&data[i], std::min(data.size() - i, (size_t)AMBILIGHT_SERIAL_CHUNK + 1)});
+    }
+
+    // Send all changes without waiting for a response to each, then check that the
+    // Arduino got them all intact. If it did last time, it may be refreshing SPI LEDs now,
+    // so also don't wait for it to finish before sending the start of this frame. (With
+    // WS281x LEDs, it only acknowledges the stream once the refresh is done.)
+    void stream() {
+        const uint8_t handshake[] = {'<', 'R', 'G', 'B', 'D', 'A', 'T', 'A'};
+        if (perPair && sentKinds != kinds()) {
+            // A separate transaction that doesn't show anything; this is rare enough.
+            write(handshake);
+            write({249, kinds()});
+            write({255});
+            sentKinds = kinds();
+        }
+        bool known;
+        bool pipelined = acked;
+        if (pipelined) {
+            put(handshake);
+            auto n = encodeStream(false);
+            auto head = std::min(n, AMBILIGHT_SERIAL_RING - sizeof(handshake));
+            send({frame.data(), head});
+            known = port->read() == '>';
+            send({frame.data() + head, n - head});
+        } else {
+            // Without an acknowledged stream, `shown` may not match what the Arduino
+            // has, so even if it has a frame, all of it needs to be sent.
+            known = write(handshake);
+            send({frame.data(), encodeStream(true)});
+        }
+        // If the Arduino has lost the last frame while this one was already on its way,
+        // it will reject this one, and it's just as damaged as if the data was lost.
+        acked = port->read() == '>' && known;
+        for (size_t strip = 0; strip < 4; strip++)
+            if (acked)
+                memcpy(shown[strip].data(), color[strip].data(), shown[strip].size());
+            else
+                // The data was damaged, so resend everything next time.
+                std::fill(valid[strip].begin(), valid[strip].end(), false);
+    }
+
+    // Encode a stream of all changes (or everything, if `force` is set) into `frame`,
+    // and return its size.
+    size_t encodeStream(bool force) {
+        size_t n = 0;
+        uint8_t s1 = 0, s2 = 0;
+        auto append = [&](util::span<const uint8_t> data) {
+            for (auto b : data)
+                s1 += b, s2 += s1; // Fletcher-16, modulo 256 for speed on the Arduino's side.
+            memcpy(&frame[n], &data[0], data.size());
+            n += data.size();
+        };
+        // A chunk index byte, or a 16-bit chunk record header; see `arduino.ino`.
+        const size_t header = extended ? 4 : 1;
+        frame[n++] = force ? 251 : 252;
+        for (size_t strip = 0; strip < 4; strip++) {
+            size_t dirty = 0;
+            for (size_t chunk = 0; chunk < chunks; chunk++)
+                dirty += force || !valid[strip][chunk];
+            if (!dirty)
+                continue;
+            // Sparse changes are cheaper to send as patches, but if most of the strip
+            // has changed, the fixed-size chunks have less overhead.
+            if (auto size = encodePatches(strip, force, dirty * (chunkSize + header))) {
+                append({patches.data(), size});
+                std::fill(valid[strip].begin(), valid[strip].begin() + chunks, true);
+                continue;
+            }
+            for (size_t chunk = 0; chunk < chunks; chunk++) if (force || !valid[strip][chunk]) {
+                if (extended)
+                    append({250, (uint8_t)strip, (uint8_t)chunk, (uint8_t)(chunk >> 8)});
+                else
+                    append({(uint8_t)(strip + chunk * 4)});
+                append({&color[strip][chunk * chunkSize], chunkSize});
+                valid[strip][chunk] = true;
+            }
+        }
+        append({end()});
+        frame[n++] = s1;
+        frame[n++] = s2;
+        return n;
+    }
+
+    // Encode the differences between `color[strip]` and `shown[strip]` (or all of
+    // `color[strip]` if `force` is set) into `patches` as a series of records, each one
+    // of these:
+    //
+    //     253, strip, offset (2 bytes, little endian), length, [length bytes]
+    //     252, strip, offset (2 bytes, little endian), length, period, [period bytes]
+    //
+    // The first overwrites bytes starting at `offset`, the second fills them by repeating
+    // a pattern (e.g. a single LED's color). Return the total size, or 0 if it would
+    // not be less than `limit`.
+    size_t encodePatches(size_t strip, bool force, size_t limit) {
+        const uint8_t* now = color[strip].data();
+        const uint8_t* was = shown[strip].data();
+        const size_t size = shown[strip].size();
+        limit = std::min(limit, patches.size());
+        size_t n = 0;
+        auto header = [&](uint8_t kind, size_t offset, size_t length) {
+            uint8_t h[] = {kind, (uint8_t)strip, (uint8_t)offset, (uint8_t)(offset >> 8), (uint8_t)length};
+            memcpy(&patches[n], h, sizeof(h));
+            n += sizeof(h);
+        };
+        auto literal = [&](size_t from, size_t to) {
+            for (size_t length; from < to; from += length) {
+                length = std::min(to - from, (size_t)255);
+                if (n + length + 5 >= limit)
+                    return false;
+                header(253, from, length);
+                memcpy(&patches[n], now + from, length);
+                n += length;
+            }
+            return true;
+        };
+        for (size_t i = 0; i < size; ) {
+            if (!force && now[i] == was[i]) {
+                i++;
+                continue;
+            }
+            // Gaps shorter than a record header are cheaper to resend than to skip.
+            size_t end = i + 1;
+            for (size_t j = end; j < size && j - end < 5; j++)
+                if (force || now[j] != was[j])
+                    end = j + 1;
+            size_t pending = i;
+            while (i < end) {
+                size_t best = 0, period = 0;
+                for (size_t p = 1; p <= 4 && i + p <= end; p++) {
+                    size_t length = p;
+                    while (i + length < end && length < 255 && now[i + length] == now[i + length - p])
+                        length++;
+                    if (length - p > best - period)
+                        best = length, period = p;
+                }
+                // A fill in the middle of a literal costs two extra headers.
+                if (best < period + 16) {
+                    i++;
+                    continue;
+                }
+                if (!literal(pending, i) || n + 6 + period >= limit)
+                    return 0;
+                header(252, i, best);
+                patches[n++] = (uint8_t)period;
+                memcpy(&patches[n], now + i, period);
+                n += period;
+                pending = i += best;
+            }
+            if (!literal(pending, end))
+                return 0;
+        }
+        return n;
     }
 
 private:
-    winapi::handle handle;
-    uint8_t color[4][AMBILIGHT_CHUNKS_PER_STRIP][AMBILIGHT_SERIAL_CHUNK] = {};
-    bool    valid[4][AMBILIGHT_CHUNKS_PER_STRIP] = {};
+    std::unique_ptr<serial_port> port;
+    // Until the Arduino says otherwise, assume it was built with the same settings.
+    size_t chunkSize = AMBILIGHT_SERIAL_CHUNK;
+    // (The original chunk index byte can't address more than 62 chunks.)
+    size_t chunks = std::min(AMBILIGHT_CHUNKS_PER_STRIP, 62);
+    // Number of LEDs in the last `update` of each strip, and their kind.
+    size_t leds[4] = {};
+    bool spiStrip[4] = {};
+    // Rounding error of each channel of each dithered LED, and whether any is non-zero.
+    std::vector<int16_t> error[4];
+    bool unsettled[4] = {};
+    // Encoded LEDs, which may be more than the Arduino can hold; only the first `chunks`
+    // chunks are sent.
+    std::vector<uint8_t> color[4];
+    std::vector<bool>    valid[4];
+    // The strip being encoded, before it's compared to `color`.
+    std::vector<uint8_t> scratch;
+    // What the Arduino has acknowledged receiving; only tracked when streaming.
+    std::vector<uint8_t> shown[4];
+    std::vector<uint8_t> patches;
+    // Start byte, up to 4 strips' worth of chunks, end byte, checksum.
+    std::vector<uint8_t> frame;
+    bool negotiated = false;
+    bool streaming = false;
+    // Whether chunks have 16-bit indices.
+    bool extended = false;
+    // Whether the Arduino refreshes each pair as set by request 249, and what was set.
+    bool perPair = false;
+    uint8_t sentKinds = 0;
+    // Whether the Arduino has acknowledged the last stream.
+    bool acked = false;
+    // Bytes written since the start of the last `submit`.
+    uint64_t submitted = 0;
 };
@@ -0,0 +1,77 @@
+#include "smoothing.h"
+
+#include <algorithm>
+#include <math.h>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define SMOOTH_SSE2 1
+#endif
+
+// How much the cutoff frequency (in Hz) increases per unit of color change per second.
+// A cut from black to white at 60 fps raises it to ~60 Hz, i.e. a ~3 ms time constant.
+#define SMOOTH_BETA 1.f
+
+// Differences below this are invisible after quantization to 8 bits.
+#define SMOOTH_EPSILON (.5f / 255)
+
+static const float pi = 3.14159265358979323846f;
+
+util::span<const FLOATX4> led_smoother::update(const FLOATX4* target, float dt, float tau) {
+    output.resize(state.size());
+    if (target) {
+        for (size_t i = 0; i < state.size(); i++)
+            state[i].target = target[i];
+        if (!primed)
+            for (size_t i = 0; i < state.size(); i++)
+                output[i] = state[i].value = target[i];
+        primed = true;
+    }
+    if (!primed || dt <= 0)
+        return output;
+    if (tau <= 0) {
+        for (size_t i = 0; i < state.size(); i++)
+            output[i] = state[i].value = state[i].target;
+        done = true;
+        return output;
+    }
+    // alpha = 1 / (1 + tau' / dt), where tau' = 1 / (2pi * fc) and fc = fc0 + beta * speed.
+    const float fc0 = 1 / (2 * pi * tau);
+    const float k = 2 * pi * dt;
+    float maxDelta = 0;
+#ifdef SMOOTH_SSE2
+    const __m128 mask = _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1)); // |rgb|, ignore alpha
+    const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+    const __m128 one = _mm_set1_ps(1);
+    __m128 maxAll = _mm_setzero_ps();
+    for (size_t i = 0; i < state.size(); i++) {
+        __m128 y = _mm_loadu_ps(&state[i].value.r);
+        __m128 x = _mm_loadu_ps(&state[i].target.r);
+        __m128 d = _mm_sub_ps(x, y);
+        __m128 ad = _mm_and_ps(_mm_and_ps(d, absMask), mask);
+        // Horizontal max of the three color channels.
+        __m128 m = _mm_max_ps(ad, _mm_shuffle_ps(ad, ad, _MM_SHUFFLE(2, 3, 0, 1)));
+        m = _mm_max_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+        __m128 kfc = _mm_mul_ps(_mm_set1_ps(k), _mm_add_ps(_mm_set1_ps(fc0), _mm_mul_ps(_mm_set1_ps(SMOOTH_BETA / dt), m)));
+        __m128 alpha = _mm_div_ps(kfc, _mm_add_ps(one, kfc));
+        y = _mm_add_ps(y, _mm_mul_ps(alpha, d));
+        _mm_storeu_ps(&state[i].value.r, y);
+        _mm_storeu_ps(&output[i].r, y);
+        maxAll = _mm_max_ps(maxAll, _mm_mul_ps(_mm_sub_ps(one, alpha), m));
+    }
+    _mm_store_ss(&maxDelta, maxAll);
+#else
+    for (size_t i = 0; i < state.size(); i++) {
+        auto& s = state[i];
+        auto d = s.target.apply([](float x, float y) { return x - y; }, s.value);
+        float m = std::max({fabsf(d.r), fabsf(d.g), fabsf(d.b)});
+        float kfc = k * (fc0 + SMOOTH_BETA / dt * m);
+        float alpha = kfc / (1 + kfc);
+        s.value = s.value.apply([&](float y, float e) { return y + alpha * e; }, d);
+        output[i] = s.value;
+        maxDelta = std::max(maxDelta, (1 - alpha) * m);
+    }
+#endif
+    done = maxDelta < SMOOTH_EPSILON;
+    return output;
+}
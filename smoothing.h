@@ -0,0 +1,35 @@
+#pragma once
+
+#include "color.hpp"
+#include "dxui/span.hpp"
+
+#include <stdint.h>
+#include <vector>
+
+// Per-LED adaptive exponential smoothing, a simplified one-euro filter: the cutoff
+// frequency rises with the speed at which the color changes, so noise and slow drifts
+// are smoothed heavily while scene cuts pass through within a frame or two.
+struct led_smoother {
+    led_smoother(size_t n) : state(n) {}
+
+    // Move each output color towards the corresponding target color as if `dt` seconds
+    // have passed since the previous update; `tau` is the time constant in seconds for
+    // colors that barely change, with 0 meaning no smoothing at all. If `target` is null,
+    // continue moving towards the previous targets.
+    util::span<const FLOATX4> update(const FLOATX4* target, float dt, float tau);
+
+    // Whether the outputs are indistinguishable from the targets, i.e. further updates
+    // without new targets would have no visible effect.
+    bool settled() const { return done; }
+
+private:
+    struct led {
+        FLOATX4 value;
+        FLOATX4 target;
+    };
+
+    std::vector<led> state;
+    std::vector<FLOATX4> output;
+    bool primed = false;
+    bool done = true;
+};
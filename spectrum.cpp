@@ -0,0 +1,227 @@
+#include "spectrum.h"
+
+#include <algorithm>
+#include <iterator>
+#include <math.h>
+
+// Analyze audio with `octave_filterbank` rather than `spectrum`. The filterbank costs about
+// a sixth as much and separates octaves far more cleanly, but the lowest one lags behind by
+// ~90 ms instead of ~20 ms, which is very visible on kick drums.
+#define AUDIO_FILTERBANK 0
+
+// The minimal frequency resolved by DFT.
+#define DFT_RESOLUTION 25
+
+// The number of DFT runs per unit of resolution (i.e. the update frequency
+// is the product of this and DFT_RESOLUTION).
+#define DFT_RUNS_PER_FILL 4
+
+// EWMA coefficients for merging consecutive updates. Greater = smoother.
+#define DFT_EWMA_RISE 0.50f
+#define DFT_EWMA_DROP 0.96f
+
+// Coefficients of the allpass sections of the filterbank's half-band filters, alternating
+// between the two polyphase branches: an elliptic design with a transition band from 0.2 to
+// 0.3 of the sample rate and ~53 dB of stopband attenuation (de Soras, "hiir"). Below the
+// transition band, each stage delays its output by about 2 samples at its input rate.
+static const float halfband[3] = {0.128456349f, 0.429566741f, 0.790675504f};
+
+// The power of each octave is averaged over this many periods of its lowest frequency,
+// or over the time between updates if that is longer.
+#define FILTERBANK_PERIODS 1
+
+static const double pi = 3.14159265358979323846;
+
+// Compute floor(log2(x)) + 1, i.e. the number of octaves in a range of x uniformly
+// distributed frequencies.
+static size_t log2fp1(size_t i) {
+    size_t r = 0;
+    for (; i; i >>= 1) r++;
+    return r;
+}
+
+// The number of samples per DFT run.
+static size_t dftSize(uint32_t sampleRate) {
+    // FFT works fastest when the sample count is a product of powers of 2, 3, and 5.
+    return kiss_fftr_next_fast_size_real(sampleRate / DFT_RESOLUTION);
+}
+
+// Merge a new measurement of an octave into its smoothed amplitude.
+static void smooth(float& out, float m) {
+    out = (out - m) * (m > out ? DFT_EWMA_RISE : DFT_EWMA_DROP) + m;
+}
+
+std::unique_ptr<audio_analyzer> makeAudioAnalyzer(uint32_t sampleRate) {
+#if AUDIO_FILTERBANK
+    return std::make_unique<octave_filterbank>(sampleRate);
+#else
+    return std::make_unique<spectrum>(sampleRate);
+#endif
+}
+
+spectrum::spectrum(uint32_t sampleRate) {
+    size_t n = dftSize(sampleRate);
+    for (auto& sv : samples)
+        sv.resize(n);
+    untilRun = n;
+    // Both channels go through one complex FFT, so that's only one transform per run.
+    fft.reset(kiss_fft_alloc((int)n, 0, nullptr, nullptr));
+    fftInput.resize(n);
+    fftBuffer.resize(n);
+    // Output range: [0, DFT_RESOLUTION, DFT_RESOLUTION*2, ..., Nyquist frequency].
+    for (auto& mv : magnitudes)
+        mv.resize(n / 2 + 1);
+    // Discard 0 Hz, group the rest into octaves.
+    mapped.resize(log2fp1(n / 2) * std::size(samples));
+}
+
+bool spectrum::feed(const float* left, const float* right, size_t frames) {
+    bool haveUpdates = false;
+    const size_t n = samples[0].size();
+    while (frames) {
+        // Copy as much as possible before either wrapping around or having to run the DFT.
+        size_t k = std::min({frames, n - nextSample, untilRun});
+        const float* in[] = {left, right};
+        for (size_t j = 0; j < std::size(samples); j++) {
+            if (left)
+                std::copy(in[j], in[j] + k, &samples[j][nextSample]);
+            else
+                std::fill(&samples[j][nextSample], &samples[j][nextSample] + k, 0.f);
+        }
+        if (left)
+            left += k, right += k;
+        frames -= k;
+        if ((nextSample += k) == n)
+            nextSample = 0;
+        if (untilRun -= k)
+            continue; // Not enough for a DFT run yet.
+        untilRun = n / DFT_RUNS_PER_FILL;
+        if (left) {
+            // The oldest sample is the one about to be overwritten, so the window is the rest
+            // of the ring followed by its beginning. Left is real, right is imaginary.
+            auto* out = fftInput.data();
+            for (size_t i = nextSample; i < n; i++)
+                *out++ = {samples[0][i], samples[1][i]};
+            for (size_t i = 0; i < nextSample; i++)
+                *out++ = {samples[0][i], samples[1][i]};
+            kiss_fft(fft.get(), fftInput.data(), fftBuffer.data());
+            splitChannels();
+            size_t part = mapped.size() / std::size(samples);
+            for (size_t j = 0; j < std::size(samples); j++)
+                mapFreqToOctaves(magnitudes[j], {&mapped[j * part], part});
+            haveUpdates = true;
+        } else if (std::any_of(mapped.begin(), mapped.end(), [](float c) { return c > 1e-5; })) {
+            for (auto& c : mapped) c *= DFT_EWMA_DROP;
+            haveUpdates = true;
+        }
+    }
+    return haveUpdates;
+}
+
+void spectrum::splitChannels() {
+    // With z = x + iy, where x and y are real, Z[k] = X[k] + iY[k] and conj(Z[n-k]) = X[k] - iY[k].
+    // So X[k] = (Z[k] + conj(Z[n-k])) / 2 and Y[k] = (Z[k] - conj(Z[n-k])) / 2i.
+    const size_t n = fftBuffer.size();
+    for (size_t k = 0; k < magnitudes[0].size(); k++) {
+        const auto& a = fftBuffer[k];
+        const auto& b = fftBuffer[k ? n - k : 0];
+        float xr = a.r + b.r, xi = a.i - b.i;
+        float yr = a.i + b.i, yi = b.r - a.r;
+        magnitudes[0][k] = sqrtf(xr * xr + xi * xi) / 2;
+        magnitudes[1][k] = sqrtf(yr * yr + yi * yi) / 2;
+    }
+}
+
+void spectrum::mapFreqToOctaves(util::span<const float> in, util::span<float> out) {
+    // assert(out.size() < in.size());
+    for (size_t i = 1, j = 0; j < out.size(); j++) {
+        float m = 0;
+        for (size_t q = 1ull << j, d = 0; q-- && i < in.size(); i++)
+            m += (in[i] - m) / ++d;
+        smooth(out[j], m);
+    }
+}
+
+octave_filterbank::octave_filterbank(uint32_t sampleRate) {
+    // Same octaves, update rate, and scale as `spectrum`, except that the octaves are
+    // aligned to the Nyquist frequency rather than to multiples of DFT_RESOLUTION.
+    size_t n = dftSize(sampleRate);
+    size_t count = log2fp1(n / 2);
+    hop = untilRun = n / DFT_RUNS_PER_FILL;
+    mapped.resize(count * std::size(stages));
+    for (auto& ch : stages) {
+        ch.resize(count);
+        for (size_t s = 0; s < count; s++) {
+            // Stage `s` outputs at 1/2^(s+1) of the sample rate, and its octave starts at half that.
+            double rate = (double)sampleRate / (2ull << s);
+            double tau = std::max((double)hop / sampleRate, FILTERBANK_PERIODS / (rate / 2));
+            ch[s].alpha = (float)(1 - exp(-1 / (tau * rate)));
+            // White noise with a variance of v has a mean square of 2v*bins/n in an octave that
+            // spans `bins` bins, and a mean magnitude of sqrt(pi*v*n)/2 in each of those bins,
+            // which `spectrum` averages. A pure tone comes out louder than with `spectrum` by
+            // about sqrt(bins), since the FFT spreads it over fewer bins than it averages.
+            size_t j = count - 1 - s;
+            size_t bins = std::min<size_t>(1ull << j, n / 2 + 1 - (1ull << j));
+            ch[s].scale = (float)(sqrt(pi * n / 4) * sqrt(n / 2. / bins));
+        }
+    }
+}
+
+bool octave_filterbank::feed(const float* left, const float* right, size_t frames) {
+    bool haveUpdates = false;
+    if (!left)
+        // Feeding zeros would only decay the filters' states towards 0 through denormals,
+        // which are very slow, so skip to the end.
+        for (auto& ch : stages)
+            for (auto& st : ch) {
+                std::fill(std::begin(st.x), std::end(st.x), 0.f);
+                std::fill(std::begin(st.y), std::end(st.y), 0.f);
+                st.held = st.power = 0;
+            }
+    while (frames) {
+        size_t k = std::min(frames, untilRun);
+        if (left) {
+            for (size_t i = 0; i < k; i++) {
+                push(stages[0], left[i]);
+                push(stages[1], right[i]);
+            }
+            left += k, right += k;
+        }
+        frames -= k;
+        if (untilRun -= k)
+            continue;
+        untilRun = hop;
+        if (left) {
+            size_t part = mapped.size() / std::size(stages);
+            for (size_t j = 0; j < std::size(stages); j++)
+                for (size_t s = 0; s < part; s++)
+                    smooth(mapped[j * part + part - 1 - s], sqrtf(stages[j][s].power) * stages[j][s].scale);
+            haveUpdates = true;
+        } else if (std::any_of(mapped.begin(), mapped.end(), [](float c) { return c > 1e-5; })) {
+            for (auto& c : mapped) c *= DFT_EWMA_DROP;
+            haveUpdates = true;
+        }
+    }
+    return haveUpdates;
+}
+
+void octave_filterbank::push(std::vector<stage>& stages, float x) {
+    for (auto& st : stages) {
+        if ((st.odd = !st.odd)) {
+            st.held = x;
+            return;
+        }
+        // The newer sample goes through the even sections, the older one (i.e. delayed by
+        // one sample at the input rate) through the odd sections.
+        float b[2] = {x, st.held};
+        for (size_t i = 0; i < std::size(halfband); i++) {
+            float& v = b[i % 2];
+            float t = (v - st.y[i]) * halfband[i] + st.x[i];
+            st.x[i] = v;
+            st.y[i] = v = t;
+        }
+        float hp = (b[0] - b[1]) / 2;
+        st.power += st.alpha * (hp * hp - st.power);
+        x = (b[0] + b[1]) / 2;
+    }
+}
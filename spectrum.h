@@ -0,0 +1,90 @@
+#pragma once
+
+#include <memory>
+#include <stdint.h>
+#include <vector>
+
+#include "kiss_fft.h"
+#include "dxui/span.hpp"
+
+struct fft_release {
+    void operator()(kiss_fft_state* p) const {
+        kiss_fft_free(p);
+    }
+};
+
+// Converts a stream of stereo samples into amplitudes averaged by octave, smoothed
+// over time. Knows nothing about where the samples come from.
+struct audio_analyzer {
+    virtual ~audio_analyzer() = default;
+
+    // Append some samples from each channel. If `left` is null, append silence instead.
+    // Return whether the output has changed.
+    virtual bool feed(const float* left, const float* right, size_t frames) = 0;
+
+    // First half is the left channel, second half is the right channel; lowest octave first.
+    virtual util::span<const float> octaves() const = 0;
+};
+
+// Create the analyzer selected by `AUDIO_FILTERBANK` in spectrum.cpp.
+std::unique_ptr<audio_analyzer> makeAudioAnalyzer(uint32_t sampleRate);
+
+// Measures octaves by averaging the bins of a real FFT, run several times per window.
+struct spectrum : audio_analyzer {
+    spectrum(uint32_t sampleRate);
+
+    bool feed(const float* left, const float* right, size_t frames) override;
+    util::span<const float> octaves() const override { return mapped; }
+
+private:
+    // Extract the magnitudes of both channels' spectra from the packed `fftBuffer`.
+    void splitChannels();
+    void mapFreqToOctaves(util::span<const float> in, util::span<float> out);
+
+private:
+    std::unique_ptr<kiss_fft_state, fft_release> fft;
+    // The last DFT window's worth of samples of each channel, as a ring buffer that wraps
+    // around at `nextSample`; copied in order into `fftInput` for each DFT run.
+    std::vector<kiss_fft_scalar> samples[2];
+    std::vector<kiss_fft_cpx> fftInput;
+    std::vector<kiss_fft_cpx> fftBuffer;
+    std::vector<float> magnitudes[2];
+    std::vector<float> mapped;
+    size_t nextSample = 0;
+    size_t untilRun = 0;
+};
+
+// Measures the same octaves with a cascade of polyphase half-band filters instead: each
+// stage splits its input into the top octave and the rest, both at half the sample rate,
+// measures the power of the former, and passes the latter on. Every octave is thus filtered
+// at the lowest rate that can hold it, which costs a few multiplications per input sample
+// in total, and lower octaves are not delayed by a window as long as the FFT's.
+struct octave_filterbank : audio_analyzer {
+    octave_filterbank(uint32_t sampleRate);
+
+    bool feed(const float* left, const float* right, size_t frames) override;
+    util::span<const float> octaves() const override { return mapped; }
+
+private:
+    struct stage {
+        // Previous input and output of each first-order allpass section.
+        float x[3] = {};
+        float y[3] = {};
+        // The first sample of the current pair, if `odd`.
+        float held = 0;
+        bool odd = false;
+        // Mean square of the top octave, as an EWMA with weight `alpha` per output sample.
+        float power = 0;
+        float alpha = 0;
+        // Converts `sqrt(power)` to the scale of `spectrum`'s output.
+        float scale = 0;
+    };
+
+    static void push(std::vector<stage>& stages, float x);
+
+private:
+    std::vector<stage> stages[2];
+    std::vector<float> mapped;
+    size_t hop = 0;
+    size_t untilRun = 0;
+};
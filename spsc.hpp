@@ -0,0 +1,78 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// A fixed-size FIFO with one producer thread and one consumer thread, neither of which ever
+// blocks the other. Each side only writes its own index, publishing the items it has copied
+// with a release store that the other side reads with an acquire load. If the consumer falls
+// behind, whole pushes are dropped (and counted) instead of overwriting unread items, so the
+// consumer sees gaps rather than torn data.
+template <typename T>
+struct spsc_ring {
+    explicit spsc_ring(size_t capacity)
+        : items(capacity)
+    {}
+
+    // Producer: append `n` items, or `n` default-constructed ones if `data` is null. Return
+    // false and append nothing if there is not enough space for all of them.
+    bool push(const T* data, size_t n) {
+        auto tail = written.load(std::memory_order_relaxed);
+        if (n > items.size() - (size_t)(tail - read.load(std::memory_order_acquire))) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        auto at = (size_t)(tail % items.size());
+        auto k = std::min(n, items.size() - at);
+        if (data) {
+            std::copy(data, data + k, &items[at]);
+            std::copy(data + k, data + n, &items[0]);
+        } else {
+            std::fill(&items[at], &items[at] + k, T{});
+            std::fill(&items[0], &items[0] + (n - k), T{});
+        }
+        written.store(tail + n, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer: call `f(const T*, size_t)` on the oldest items, up to `n` of them, in at most
+    // two contiguous slices, then discard them. Return how many there were.
+    template <typename F>
+    size_t pop(size_t n, F&& f) {
+        auto head = read.load(std::memory_order_relaxed);
+        n = std::min(n, (size_t)(written.load(std::memory_order_acquire) - head));
+        auto at = (size_t)(head % items.size());
+        auto k = std::min(n, items.size() - at);
+        if (k)
+            f(&items[at], k);
+        if (n - k)
+            f(&items[0], n - k);
+        read.store(head + n, std::memory_order_release);
+        return n;
+    }
+
+    // Either side: the number of items currently queued. Only a hint for the producer.
+    size_t size() const {
+        return (size_t)(written.load(std::memory_order_acquire) - read.load(std::memory_order_acquire));
+    }
+
+    size_t capacity() const {
+        return items.size();
+    }
+
+    // Either side: the number of times `push` failed because the queue was full.
+    uint64_t overruns() const {
+        return dropped.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::vector<T> items;
+    // Monotonic counts of items ever pushed and popped; the difference is the queue depth.
+    // Kept on separate cache lines so that the two threads do not fight over them.
+    alignas(64) std::atomic<uint64_t> written{0};
+    alignas(64) std::atomic<uint64_t> read{0};
+    alignas(64) std::atomic<uint64_t> dropped{0};
+};
@@ -0,0 +1,75 @@
+#include "transfer.h"
+
+#include <algorithm>
+#include <math.h>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define TRANSFER_SSE2 1
+#endif
+
+void transfer_lut::update(const settings& config, uint8_t strip) {
+    auto g = config.gamma.load();
+    auto t = config.temperature.load();
+    auto l = strip < 2 ? pow(config.minLevel, 1 / g) : 0;
+    auto u = strip < 2 ? config.brightnessV.load() : config.brightnessA.load();
+    if (g == gamma && t == temperature && l == lower && u == upper)
+        return;
+    gamma = g, temperature = t, lower = l, upper = u;
+    auto white = k2rgba((float)t);
+    const float y[3] = {white.r, white.g, white.b};
+    for (size_t c = 0; c < 3; c++)
+        for (size_t i = 0; i <= TRANSFER_LUT_SIZE; i++) {
+            double x = (double)i / TRANSFER_LUT_SIZE;
+            table[c][i] = (float)(65535 * pow((x * u * (1 - l) + l) * y[c], g));
+        }
+}
+
+FLOATX4 transfer_lut::operator()(FLOATX4 color) const {
+    float out[3];
+    const float in[3] = {color.r, color.g, color.b};
+    for (size_t c = 0; c < 3; c++) {
+        float f = std::min(std::max(in[c], 0.f), 1.f) * TRANSFER_LUT_SIZE;
+        auto i = std::min((uint32_t)f, (uint32_t)TRANSFER_LUT_SIZE - 1);
+        out[c] = table[c][i] + (f - i) * (table[c][i + 1] - table[c][i]);
+    }
+    return {out[0], out[1], out[2], color.a};
+}
+
+void transfer_lut::apply(const FLOATX4* in, FLOATX4* out, size_t n) const {
+    size_t k = 0;
+#ifdef TRANSFER_SSE2
+    // Four colors at a time, transposed to one channel per register; only the table
+    // lookups themselves are scalar.
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1);
+    const __m128 size = _mm_set1_ps(TRANSFER_LUT_SIZE);
+    const __m128i last = _mm_set1_epi32(TRANSFER_LUT_SIZE - 1);
+    auto channel = [&](__m128 x, const float* row) {
+        __m128 f = _mm_mul_ps(_mm_min_ps(_mm_max_ps(x, zero), one), size);
+        __m128i i = _mm_cvttps_epi32(f);
+        // min(i, last) for non-negative 32-bit integers, without SSE4.1.
+        __m128i over = _mm_cmpgt_epi32(i, last);
+        i = _mm_or_si128(_mm_and_si128(over, last), _mm_andnot_si128(over, i));
+        __m128 t = _mm_sub_ps(f, _mm_cvtepi32_ps(i));
+        alignas(16) int32_t j[4];
+        _mm_store_si128((__m128i*)j, i);
+        __m128 lo = _mm_setr_ps(row[j[0]], row[j[1]], row[j[2]], row[j[3]]);
+        __m128 hi = _mm_setr_ps(row[j[0] + 1], row[j[1] + 1], row[j[2] + 1], row[j[3] + 1]);
+        return _mm_add_ps(lo, _mm_mul_ps(t, _mm_sub_ps(hi, lo)));
+    };
+    for (; k + 4 <= n; k += 4) {
+        __m128 r = _mm_load_ps(&in[k].r), g = _mm_load_ps(&in[k + 1].r);
+        __m128 b = _mm_load_ps(&in[k + 2].r), a = _mm_load_ps(&in[k + 3].r);
+        _MM_TRANSPOSE4_PS(r, g, b, a);
+        r = channel(r, table[0]);
+        g = channel(g, table[1]);
+        b = channel(b, table[2]);
+        _MM_TRANSPOSE4_PS(r, g, b, a);
+        _mm_store_ps(&out[k].r, r), _mm_store_ps(&out[k + 1].r, g);
+        _mm_store_ps(&out[k + 2].r, b), _mm_store_ps(&out[k + 3].r, a);
+    }
+#endif
+    for (; k < n; k++)
+        out[k] = (*this)(in[k]);
+}
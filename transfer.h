@@ -0,0 +1,32 @@
+#pragma once
+
+#include "color.hpp"
+#include "config.hpp"
+
+#include <stdint.h>
+
+// Number of intervals in each channel's lookup table. For gamma >= 1, linear interpolation
+// between entries is within a fraction of a 16-bit step of the exact curve.
+#define TRANSFER_LUT_SIZE 1024
+
+// Maps colors from `frameData` to 16-bit LED levels: scales by brightness, lifts by the
+// minimum level, tints by the white point, and applies gamma. All of that is folded into
+// a lookup table per channel, which is only rebuilt when the settings change.
+struct transfer_lut {
+    // Rebuild the tables if any relevant setting has changed since the last call.
+    // Strips 0 and 1 use the video brightness and minimum level, 2 and 3 the audio ones.
+    void update(const settings& config, uint8_t strip);
+
+    // Transform a single color; alpha is passed through.
+    FLOATX4 operator()(FLOATX4 color) const;
+
+    // Transform n colors at once.
+    void apply(const FLOATX4* in, FLOATX4* out, size_t n) const;
+
+private:
+    double gamma = 0;
+    double temperature = 0;
+    double lower = -1;
+    double upper = 0;
+    float table[3][TRANSFER_LUT_SIZE + 1];
+};
@@ -0,0 +1,146 @@
+#include "zones.h"
+
+#include <algorithm>
+#include <math.h>
+#include <string.h>
+
+std::vector<frame_rect> layoutZones(uint32_t w, uint32_t h, uint32_t iw, uint32_t ih, double depth, double overlap) {
+    // Round to whole pixels, but never make a zone empty.
+    auto span = [](double from, double to, uint32_t limit) {
+        auto a = (uint32_t)std::min(std::max(floor(from), 0.), limit - 1.);
+        auto b = (uint32_t)std::min(std::max(ceil(to), 0.), (double)limit);
+        return std::make_pair(a, std::max(b, a + 1));
+    };
+    auto d = std::max(depth, 0.) * std::min(iw, ih);
+    auto dx = (double)iw / w, dy = (double)ih / h;
+    auto hzone = [&](uint32_t x, bool bottom) {
+        auto xs = span((x - overlap) * dx, (x + 1 + overlap) * dx, iw);
+        auto ys = bottom ? span(ih - d, ih, ih) : span(0, d, ih);
+        return frame_rect{xs.first, ys.first, xs.second, ys.second};
+    };
+    auto vzone = [&](uint32_t y, bool right) {
+        auto xs = right ? span(iw - d, iw, iw) : span(0, d, iw);
+        auto ys = span((y - overlap) * dy, (y + 1 + overlap) * dy, ih);
+        return frame_rect{xs.first, ys.first, xs.second, ys.second};
+    };
+    std::vector<frame_rect> zones;
+    for (auto x = w; x--; ) zones.push_back(hzone(x, true));  // bottom right -> bottom left
+    for (auto y = h; y--; ) zones.push_back(vzone(y, false)); // bottom left -> top left
+    for (auto y = h; y--; ) zones.push_back(vzone(y, true));  // bottom right -> top right
+    for (auto x = w; x--; ) zones.push_back(hzone(x, false)); // top right -> top left
+    zones.push_back({0, 0, iw, ih});
+    return zones;
+}
+
+zone_sampler::zone_sampler(uint32_t w, uint32_t h, uint32_t iw, uint32_t ih, double depth, double overlap)
+    : iw(iw), ih(ih), zones(layoutZones(w, h, iw, ih, depth, overlap)), table((iw + 1) * (ih + 1) * 4)
+{}
+
+void zone_sampler::update(util::span<const FLOATX4> image) {
+    // The first row and column are always zero.
+    const size_t stride = (iw + 1) * 4;
+    for (uint32_t y = 0; y < ih; y++) {
+        double row[4] = {0, 0, 0, 0};
+        const double* above = &table[y * stride + 4];
+        double* out = &table[(y + 1) * stride + 4];
+        for (uint32_t x = 0; x < iw; x++, above += 4, out += 4) {
+            const auto& c = image[y * iw + x];
+            out[0] = above[0] + (row[0] += c.r);
+            out[1] = above[1] + (row[1] += c.g);
+            out[2] = above[2] + (row[2] += c.b);
+            out[3] = above[3] + (row[3] += c.a);
+        }
+    }
+}
+
+FLOATX4 zone_sampler::average(size_t zone) const {
+    const auto& z = zones[zone];
+    const size_t stride = (iw + 1) * 4;
+    const double* a = &table[z.top    * stride + z.left  * 4];
+    const double* b = &table[z.top    * stride + z.right * 4];
+    const double* c = &table[z.bottom * stride + z.left  * 4];
+    const double* d = &table[z.bottom * stride + z.right * 4];
+    const double n = (double)(z.right - z.left) * (z.bottom - z.top);
+    return {(float)((d[0] - b[0] - c[0] + a[0]) / n), (float)((d[1] - b[1] - c[1] + a[1]) / n),
+            (float)((d[2] - b[2] - c[2] + a[2]) / n), (float)((d[3] - b[3] - c[3] + a[3]) / n)};
+}
+
+void zone_sampler::sample(FLOATX4* a, FLOATX4* b) const {
+    const size_t half = (zones.size() - 1) / 2;
+    for (size_t i = 0; i < half; i++) {
+        a[i] = average(i);
+        b[i] = average(half + i);
+    }
+}
+
+zone_accumulator::zone_accumulator(uint32_t w, uint32_t h, double depth, double overlap)
+    : w(w), h(h), depth(depth), overlap(overlap)
+{}
+
+void zone_accumulator::update(const bgra_frame& frame) {
+    if (frame.width != layout.width || frame.height != layout.height
+     || frame.rotate != layout.rotate || frame.mirror != layout.mirror) {
+        layout = frame;
+        // Lay out the zones as seen on the display, then map them back onto the frame
+        // using the same rotation as `downscaler`.
+        auto dw = frame.rotate ? frame.height : frame.width;
+        auto dh = frame.rotate ? frame.width : frame.height;
+        zones = layoutZones(w, h, dw, dh, depth, overlap);
+        for (auto& z : zones) {
+            if (frame.rotate)
+                z = {z.top, frame.height - z.right, z.bottom, frame.height - z.left};
+            if (frame.mirror)
+                z = {frame.width - z.right, frame.height - z.bottom, frame.width - z.left, frame.height - z.top};
+        }
+        sums.assign(zones.size() * 4, 0);
+        shadow.assign((size_t)frame.width * frame.height * 4, 0);
+        return apply(frame, {0, 0, frame.width, frame.height});
+    }
+    if (!frame.dirty.size())
+        return apply(frame, {0, 0, frame.width, frame.height});
+    for (const auto& r : frame.dirty)
+        apply(frame, {std::min(r.left, frame.width), std::min(r.top, frame.height),
+                      std::min(r.right, frame.width), std::min(r.bottom, frame.height)});
+}
+
+void zone_accumulator::apply(const bgra_frame& frame, frame_rect dirty) {
+    for (size_t i = 0; i < zones.size(); i++) {
+        const auto& z = zones[i];
+        frame_rect r = {std::max(z.left, dirty.left), std::max(z.top, dirty.top),
+                        std::min(z.right, dirty.right), std::min(z.bottom, dirty.bottom)};
+        if (r.left >= r.right || r.top >= r.bottom)
+            continue;
+        int64_t delta[4] = {0, 0, 0, 0};
+        for (uint32_t y = r.top; y < r.bottom; y++) {
+            const uint8_t* p = frame.data + y * frame.pitch + r.left * 4;
+            const uint8_t* q = shadow.data() + ((size_t)y * frame.width + r.left) * 4;
+            // 32 bits are enough for a row of any sane width.
+            int32_t row[4] = {0, 0, 0, 0};
+            for (uint32_t x = r.left; x < r.right; x++, p += 4, q += 4)
+                for (size_t c = 0; c < 4; c++)
+                    row[c] += p[c] - q[c];
+            for (size_t c = 0; c < 4; c++)
+                delta[c] += row[c];
+        }
+        for (size_t c = 0; c < 4; c++)
+            sums[i * 4 + c] += delta[c];
+    }
+    for (uint32_t y = dirty.top; y < dirty.bottom; y++)
+        memcpy(shadow.data() + ((size_t)y * frame.width + dirty.left) * 4,
+               frame.data + y * frame.pitch + dirty.left * 4, (dirty.right - dirty.left) * 4);
+}
+
+FLOATX4 zone_accumulator::average(size_t zone) const {
+    const auto& z = zones[zone];
+    const float n = 255.f * (z.right - z.left) * (z.bottom - z.top);
+    const int64_t* s = &sums[zone * 4];
+    return {s[2] / n, s[1] / n, s[0] / n, s[3] / n};
+}
+
+void zone_accumulator::sample(FLOATX4* a, FLOATX4* b) const {
+    const size_t half = (zones.size() - 1) / 2;
+    for (size_t i = 0; i < half; i++) {
+        a[i] = average(i);
+        b[i] = average(half + i);
+    }
+}
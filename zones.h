@@ -0,0 +1,72 @@
+#pragma once
+
+#include "capture.h"
+#include "color.hpp"
+#include "dxui/span.hpp"
+
+#include <stdint.h>
+#include <vector>
+
+// Compute a rectangular zone of an iw * ih image behind each LED. The zones extend `depth`
+// (a fraction of the shorter side of the image) into the screen, and `overlap` (a fraction
+// of the distance between LEDs) into each neighbour's area. The order is the same as in
+// `frameData`: first strip 0 (bottom right -> bottom left -> top left), then strip 1 (bottom
+// right -> top right -> top left); the last zone is the entire image.
+std::vector<frame_rect> layoutZones(uint32_t w, uint32_t h, uint32_t iw, uint32_t ih, double depth, double overlap);
+
+// Averages zones in constant time from a summed-area table built once per frame.
+struct zone_sampler {
+    zone_sampler(uint32_t w, uint32_t h, uint32_t iw, uint32_t ih, double depth, double overlap);
+
+    // Build the summed-area table of an iw * ih image.
+    void update(util::span<const FLOATX4> image);
+
+    // The average color of the entire image.
+    FLOATX4 average() const { return average(zones.size() - 1); }
+
+    // Write w+h zone colors to each of the two strips.
+    void sample(FLOATX4* a, FLOATX4* b) const;
+
+private:
+    FLOATX4 average(size_t zone) const;
+
+private:
+    uint32_t iw;
+    uint32_t ih;
+    std::vector<frame_rect> zones;
+    // (iw + 1) * (ih + 1) sums of all pixels above and to the left, 4 channels each.
+    std::vector<double> table;
+};
+
+// Keeps a running sum of each zone of a full-resolution frame, and only looks at the
+// parts of the frame that have changed, so the cost of an update is proportional to
+// the changed area rather than to the size of the screen.
+struct zone_accumulator {
+    zone_accumulator(uint32_t w, uint32_t h, double depth, double overlap);
+
+    // Apply a frame's dirty rects, or rescan it entirely if it has none or if its size or
+    // orientation has changed.
+    void update(const bgra_frame& frame);
+
+    // The average color of the entire frame.
+    FLOATX4 average() const { return average(zones.size() - 1); }
+
+    // Write w+h zone colors to each of the two strips.
+    void sample(FLOATX4* a, FLOATX4* b) const;
+
+private:
+    FLOATX4 average(size_t zone) const;
+    void apply(const bgra_frame& frame, frame_rect dirty);
+
+private:
+    uint32_t w;
+    uint32_t h;
+    double depth;
+    double overlap;
+    bgra_frame layout;
+    std::vector<frame_rect> zones;
+    // 4 channels for each zone, in BGRA order.
+    std::vector<int64_t> sums;
+    // The last seen frame, for subtracting old values of changed pixels.
+    std::vector<uint8_t> shadow;
+};